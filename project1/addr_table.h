@@ -0,0 +1,147 @@
+/*! @file
+ *  Open-addressing hash table keyed by address, used on the hot path of the
+ *  tool instead of std::map. Lookups are a multiply and a linear probe over
+ *  one flat array, and the keys are sorted once with a radix sort when the
+ *  table is printed. Kept free of Pin types so it can be benchmarked alone.
+ */
+
+#ifndef ADDR_TABLE_H
+#define ADDR_TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <algorithm>
+
+template <typename V>
+class AddrTable {
+public:
+    // no address in a trace is all ones, so it marks a free slot
+    static const uint64_t EMPTY_KEY = ~(uint64_t)0;
+
+    explicit AddrTable(size_t capacity = 1024) : m_size(0), m_shift(60) {
+        size_t slots = 16;
+        while (slots < capacity * 2) {
+            slots <<= 1;
+            m_shift--;
+        }
+        m_keys.assign(slots, EMPTY_KEY);
+        m_values.resize(slots);
+    }
+
+    // return the value of `key`, inserting a default one if it is missing
+    V& operator[](uint64_t key) {
+        size_t slot = probe(key);
+        if (m_keys[slot] == EMPTY_KEY) {
+            // keep the load factor below 1/2 so probes stay short
+            if ((m_size + 1) * 2 > m_keys.size()) {
+                grow();
+                slot = probe(key);
+            }
+            m_keys[slot] = key;
+            m_size++;
+        }
+        return m_values[slot];
+    }
+
+    // return the value of `key`, or 0 if it is missing
+    V* find(uint64_t key) {
+        size_t slot = probe(key);
+        return m_keys[slot] == EMPTY_KEY ? 0 : &m_values[slot];
+    }
+
+    const V* find(uint64_t key) const {
+        size_t slot = probe(key);
+        return m_keys[slot] == EMPTY_KEY ? 0 : &m_values[slot];
+    }
+
+    bool contains(uint64_t key) const {
+        return m_keys[probe(key)] != EMPTY_KEY;
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    // append all keys to `keys` in ascending order
+    void sortedKeys(std::vector<uint64_t>& keys) const {
+        size_t first = keys.size();
+        for (size_t i = 0; i < m_keys.size(); i++) {
+            if (m_keys[i] != EMPTY_KEY) {
+                keys.push_back(m_keys[i]);
+            }
+        }
+        std::vector<uint64_t> sorted(keys.begin() + first, keys.end());
+        radixSort(sorted);
+        std::copy(sorted.begin(), sorted.end(), keys.begin() + first);
+    }
+
+    // LSD radix sort over 16-bit digits, skipping digits all keys share
+    static void radixSort(std::vector<uint64_t>& keys) {
+        std::vector<uint64_t> tmp(keys.size());
+        std::vector<size_t> counts(1 << 16);
+
+        for (unsigned shift = 0; shift < 64; shift += 16) {
+            std::fill(counts.begin(), counts.end(), 0);
+            for (size_t i = 0; i < keys.size(); i++) {
+                counts[(keys[i] >> shift) & 0xffff]++;
+            }
+            if (keys.empty() || counts[(keys[0] >> shift) & 0xffff] == keys.size()) {
+                continue;
+            }
+
+            size_t offset = 0;
+            for (size_t d = 0; d < counts.size(); d++) {
+                size_t n = counts[d];
+                counts[d] = offset;
+                offset += n;
+            }
+            for (size_t i = 0; i < keys.size(); i++) {
+                tmp[counts[(keys[i] >> shift) & 0xffff]++] = keys[i];
+            }
+            keys.swap(tmp);
+        }
+    }
+
+private:
+    // Fibonacci hashing: the top bits of the product depend on every bit of the key
+    size_t hash(uint64_t key) const {
+        return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> m_shift);
+    }
+
+    // slot holding `key`, or the free slot where it would go
+    size_t probe(uint64_t key) const {
+        size_t mask = m_keys.size() - 1;
+        size_t slot = hash(key);
+        while (m_keys[slot] != key && m_keys[slot] != EMPTY_KEY) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    void grow() {
+        std::vector<uint64_t> keys(m_keys.size() * 2, EMPTY_KEY);
+        std::vector<V> values(m_keys.size() * 2);
+        keys.swap(m_keys);
+        values.swap(m_values);
+        m_shift--;
+
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (keys[i] != EMPTY_KEY) {
+                size_t slot = probe(keys[i]);
+                m_keys[slot] = keys[i];
+                std::swap(m_values[slot], values[i]);
+            }
+        }
+    }
+
+    std::vector<uint64_t> m_keys;
+    std::vector<V> m_values;
+    size_t m_size;
+    unsigned m_shift;   // 64 - log2(number of slots)
+};
+
+template <typename V>
+const uint64_t AddrTable<V>::EMPTY_KEY;
+
+#endif
@@ -0,0 +1,92 @@
+/*! @file
+ *  Microbenchmark of the tool's accessed-address set: std::map, as the tool
+ *  used before, against AddrTable, on a synthetic trace with millions of
+ *  accesses. It times the per-access update done while tracing and the
+ *  sorted dump done in Fini.
+ *
+ *  build: c++ -O2 -std=c++11 -I.. -o addr_table_bench addr_table_bench.cpp
+ *  usage: addr_table_bench [accesses]
+ */
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <chrono>
+#include "addr_table.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+double elapsedMs(Clock::time_point start) {
+    return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+// mix of stack slots, a streaming copy and random heap accesses
+vector<uint64_t> makeTrace(size_t accesses) {
+    vector<uint64_t> trace;
+    trace.reserve(accesses);
+
+    uint64_t stack = 0x7ffee1e37000ULL;
+    uint64_t stream = 0x10ddc9000ULL;
+    uint64_t heap = 0x600000000000ULL;
+    uint64_t cursor = 0;
+    srand(1);
+
+    for (size_t i = 0; i < accesses; i++) {
+        int kind = rand() % 10;
+        if (kind < 7) {
+            trace.push_back(stack + (rand() % 512) * 8);
+        } else if (kind < 9) {
+            trace.push_back(stream + (cursor++ % (1 << 21)) * 8);
+        } else {
+            trace.push_back(heap + ((uint64_t)rand() % (1 << 23)) * 8);
+        }
+    }
+    return trace;
+}
+
+int main(int argc, char* argv[]) {
+    size_t accesses = argc > 1 ? strtoul(argv[1], 0, 10) : 10000000;
+    vector<uint64_t> trace = makeTrace(accesses);
+
+    Clock::time_point start = Clock::now();
+    map<uint64_t, uint32_t> memMap;
+    for (size_t i = 0; i < trace.size(); i++) {
+        memMap[trace[i]] = 8;
+    }
+    double mapUpdate = elapsedMs(start);
+
+    start = Clock::now();
+    vector<uint64_t> mapKeys;
+    for (map<uint64_t, uint32_t>::iterator it = memMap.begin(); it != memMap.end(); ++it) {
+        mapKeys.push_back(it->first);
+    }
+    sort(mapKeys.begin(), mapKeys.end());
+    double mapDump = elapsedMs(start);
+
+    start = Clock::now();
+    AddrTable<uint32_t> memTable(1 << 16);
+    for (size_t i = 0; i < trace.size(); i++) {
+        memTable[trace[i]] = 8;
+    }
+    double tableUpdate = elapsedMs(start);
+
+    start = Clock::now();
+    vector<uint64_t> tableKeys;
+    memTable.sortedKeys(tableKeys);
+    double tableDump = elapsedMs(start);
+
+    if (mapKeys != tableKeys) {
+        cerr << "key sets differ" << endl;
+        return 1;
+    }
+
+    cout << accesses << " accesses, " << mapKeys.size() << " distinct addresses" << endl;
+    cout << "             update (ms)   ns/access   sorted dump (ms)" << endl;
+    cout << "std::map     " << mapUpdate << "   " << mapUpdate * 1e6 / accesses << "   " << mapDump << endl;
+    cout << "AddrTable    " << tableUpdate << "   " << tableUpdate * 1e6 / accesses << "   " << tableDump << endl;
+    return 0;
+}
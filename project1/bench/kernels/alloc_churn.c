@@ -0,0 +1,131 @@
+/*
+ * Allocation churn: malloc, realloc and free in a loop, with a varying number
+ * of stores in between. The allocator is defined here, so under -heap its
+ * returns are traced code and the thread buffer fills up at every offset of
+ * an allocator's last block, including right at the return which appends the
+ * FREE and ALLOC records of a realloc. realloc(NULL, n) tail-calls malloc, so
+ * both are entered and only malloc's return is seen.
+ *
+ * usage: alloc_churn [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BYTES (64 << 20)
+#define HEADER 16
+#define CLASS_BYTES 16
+#define CLASSES 64	// blocks up to 1 KB are reused, larger ones never are
+
+// realloc(NULL, n) jumps to malloc like glibc's; clang makes tail calls at -O1, gcc needs asking
+#if defined(__GNUC__) && !defined(__clang__)
+#define TAIL_CALLS __attribute__((optimize("optimize-sibling-calls")))
+#else
+#define TAIL_CALLS
+#endif
+
+static char arena[ARENA_BYTES] __attribute__((aligned(HEADER)));
+static size_t arenaUsed;
+static void* freeBlocks[CLASSES];
+
+static size_t blockClass(size_t size)
+{
+	return (size + CLASS_BYTES - 1) / CLASS_BYTES;
+}
+
+__attribute__((noinline)) void* malloc(size_t size)
+{
+	size_t c = blockClass(size);
+	char* p;
+
+	if( c < CLASSES && freeBlocks[c] ) {
+		p = freeBlocks[c];
+		freeBlocks[c] = *(void**)p;
+		return p;
+	}
+	if( arenaUsed + HEADER + c * CLASS_BYTES > ARENA_BYTES ) {
+		return NULL;
+	}
+	p = arena + arenaUsed + HEADER;
+	arenaUsed += HEADER + c * CLASS_BYTES;
+	*(size_t*)(p - HEADER) = c;
+	return p;
+}
+
+__attribute__((noinline)) void free(void* ptr)
+{
+	size_t c;
+
+	if( !ptr ) {
+		return;
+	}
+	c = *(size_t*)((char*)ptr - HEADER);
+	if( c < CLASSES ) {
+		*(void**)ptr = freeBlocks[c];
+		freeBlocks[c] = ptr;
+	}
+}
+
+__attribute__((noinline)) void* calloc(size_t n, size_t size)
+{
+	void* p = malloc(n * size);
+
+	if( p ) {
+		memset(p, 0, n * size);
+	}
+	return p;
+}
+
+__attribute__((noinline)) TAIL_CALLS void* realloc(void* ptr, size_t size)
+{
+	size_t old;
+	void* p;
+
+	if( !ptr ) {
+		return malloc(size);
+	}
+	if( size == 0 ) {
+		free(ptr);
+		return NULL;
+	}
+	old = *(size_t*)((char*)ptr - HEADER) * CLASS_BYTES;
+	if( size <= old ) {
+		return ptr;
+	}
+	p = malloc(size);
+	if( p ) {
+		memcpy(p, ptr, old);
+		free(ptr);
+	}
+	return p;
+}
+
+int main(int argc, char** argv)
+{
+	long iterations = argc > 1 ? atol(argv[1]) : 1 << 18;
+	long sum = 0;
+	long i, j;
+
+	for( i = 0; i < iterations; i++ ) {
+		volatile char* p = malloc(16 + i % 48);
+
+		// 0 to 60 stores, so the records before the realloc shift by one per iteration
+		for( j = 0; j < i % 61; j++ ) {
+			p[j % 16] = (char)j;
+		}
+		p = realloc((void*)p, 128 + i % 256);
+		p[127] = (char)i;
+		sum += p[0] + p[127];
+		free((void*)p);
+
+		// realloc(NULL, n) is malloc(n), reached by a tail call
+		p = realloc(NULL, 16 + i % 32);
+		p[0] = (char)i;
+		sum += p[0];
+		free((void*)p);
+	}
+
+	printf("%ld\n", sum);
+	return 0;
+}
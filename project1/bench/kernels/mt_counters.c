@@ -0,0 +1,61 @@
+/*
+ * Multithreaded counters: each thread bumps its own padded counter and,
+ * every few iterations, a shared atomic one, so the tool's per-thread
+ * buffers and its shared state are both exercised.
+ *
+ * usage: mt_counters [threads] [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define MAX_THREADS 64
+
+struct counter {
+	volatile long value;
+	long pad[7];	// keep the counters on separate lines
+};
+
+struct counter counters[MAX_THREADS];
+volatile long shared;
+long iterations;
+
+void* work(void* arg)
+{
+	struct counter* mine = arg;
+	long i;
+
+	for( i = 0; i < iterations; i++ ) {
+		mine->value++;
+		if( (i & 15) == 0 ) {
+			__sync_fetch_and_add(&shared, 1);
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	int threads = argc > 1 ? atoi(argv[1]) : 4;
+	pthread_t ids[MAX_THREADS];
+	long total = 0;
+	int t;
+
+	iterations = argc > 2 ? atol(argv[2]) : 1 << 20;
+	if( threads < 1 || threads > MAX_THREADS ) {
+		fprintf(stderr, "threads must be 1..%d\n", MAX_THREADS);
+		return 1;
+	}
+
+	for( t = 0; t < threads; t++ ) {
+		pthread_create(&ids[t], 0, work, &counters[t]);
+	}
+	for( t = 0; t < threads; t++ ) {
+		pthread_join(ids[t], 0);
+		total += counters[t].value;
+	}
+
+	printf("%ld %ld\n", total, shared);
+	return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Pointer chasing: follow a random cycle through an array of nodes, so each
+ * load depends on the previous one and lands on an unpredictable line.
+ *
+ * usage: pointer_chase [nodes] [steps]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct node {
+	struct node* next;
+	long pad[7];	// one node per 64 byte line
+};
+
+int main(int argc, char** argv)
+{
+	long n = argc > 1 ? atol(argv[1]) : 1 << 16;
+	long steps = argc > 2 ? atol(argv[2]) : 1 << 22;
+	struct node* nodes = malloc(n * sizeof(struct node));
+	long* order = malloc(n * sizeof(long));
+	struct node* p;
+	long i;
+
+	// a random permutation, linked into one cycle
+	for( i = 0; i < n; i++ ) {
+		order[i] = i;
+	}
+	srand(1);
+	for( i = n - 1; i > 0; i-- ) {
+		long j = rand() % (i + 1);
+		long t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	for( i = 0; i < n; i++ ) {
+		nodes[order[i]].next = &nodes[order[(i + 1) % n]];
+	}
+
+	p = &nodes[order[0]];
+	for( i = 0; i < steps; i++ ) {
+		p = p->next;
+	}
+
+	printf("%ld\n", (long)(p - nodes));
+	free(order);
+	free(nodes);
+	return 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * Streaming copy: a[i] = b[i] over arrays larger than the caches, so every
+ * access goes to a new address and the trace grows with every iteration.
+ *
+ * usage: stream_copy [elements] [passes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char** argv)
+{
+	long n = argc > 1 ? atol(argv[1]) : 1 << 20;
+	int passes = argc > 2 ? atoi(argv[2]) : 4;
+	double* a = malloc(n * sizeof(double));
+	double* b = malloc(n * sizeof(double));
+	double sum = 0;
+	long i;
+	int p;
+
+	for( i = 0; i < n; i++ ) {
+		b[i] = (double)i;
+	}
+
+	for( p = 0; p < passes; p++ ) {
+		for( i = 0; i < n; i++ ) {
+			a[i] = b[i];
+		}
+		sum += a[n - 1 - p % n];
+	}
+
+	printf("%f\n", sum);
+	free(a);
+	free(b);
+	return 0;
+}
@@ -0,0 +1,146 @@
+#!/bin/bash
+#
+# Instrumentation overhead benchmark. Builds target/target.c and the kernels
+# in bench/kernels, runs each natively, under Pin with no tool and under each
+# tracer mode, and reports per run:
+#
+#   seconds     best wall time of REPEAT runs
+#   slowdown    seconds over the native seconds
+#   rss_mb      peak resident set size, of Pin and the tool for Pin runs
+#   trace_mb    bytes of all files the tool wrote
+#   bytes/Mins  trace bytes per million traced instructions, the instructions
+#               being counted by the -profile run of the same benchmark
+#
+# usage: bench/run_bench.sh [benchmark...]     (from project1, after compile.sh)
+# environment: PIN (pin), TOOL (bin/project1.dylib), REPEAT (3), CC (cc), TIME (/usr/bin/time),
+#              MODES to pick modes by name, e.g. MODES="profile binary"
+# Benchmarks named on the command line are run alone.
+
+cd "$(dirname "$0")/.." || exit 1
+
+PIN=${PIN:-pin}
+TOOL=${TOOL:-bin/project1.dylib}
+REPEAT=${REPEAT:-3}
+CC=${CC:-cc}
+TIME=${TIME:-/usr/bin/time}
+OBJ=bench/obj
+ONLY="$*"
+
+# name and arguments of each benchmark, sized so the text trace stays in the hundreds of MB
+BENCHMARKS=(
+    "target"
+    "stream_copy 262144 4"
+    "pointer_chase 65536 1048576"
+    "mt_counters 4 262144"
+    "alloc_churn 262144"
+)
+
+# name and tool options of each tracer mode
+ALL_MODES=(
+    "profile|-profile"
+    "text|"
+    "binary|-binary"
+    "binary_z|-binary -compress"
+    "stream|-stream"
+    "stream_z|-stream -compress"
+    "sample16|-binary -sample 16"
+    "cache|-binary -cache 32K:8:64 -cache 1M:16:64"
+    "heap|-binary -heap bench/obj/out/heap.txt"
+)
+
+mkdir -p $OBJ
+$CC -O1 -w -o $OBJ/target target/target.c || exit 1
+for src in bench/kernels/*.c; do
+    $CC -O1 -Wall -pthread -o $OBJ/$(basename $src .c) $src || exit 1
+done
+
+if [ ! -x "$TIME" ]; then
+    echo "$TIME not found, it measures the time and peak RSS of each run" >&2
+    exit 1
+fi
+if [ ! -f "$TOOL" ]; then
+    echo "$TOOL not found, build it with compile.sh first" >&2
+    exit 1
+fi
+
+# "{seconds} {peak rss bytes}" of the command, its output discarded
+measure() {
+    local log=$OBJ/time.log
+    if [ "$(uname)" = Darwin ]; then
+        $TIME -l -p "$@" > /dev/null 2> $log
+        awk '/^real/ { s = $2 } /maximum resident set size/ { m = $1 } END { print s, m }' $log
+    else
+        $TIME -f "time %e %M" "$@" > /dev/null 2> $log
+        awk '/^time/ { s = $2; m = $3 * 1024 } END { print s, m }' $log
+    fi
+}
+
+# best of REPEAT runs, "{seconds} {peak rss bytes}"
+best() {
+    local bestSec="" bestRss=0
+    for ((i = 0; i < REPEAT; i++)); do
+        read sec rss <<< "$(measure "$@")"
+        if [ -z "$bestSec" ] || awk "BEGIN { exit !($sec < $bestSec) }"; then
+            bestSec=$sec
+        fi
+        if [ "$rss" -gt "$bestRss" ]; then
+            bestRss=$rss
+        fi
+    done
+    echo $bestSec $bestRss
+}
+
+# bytes of the files written to a fresh output directory
+traceBytes() {
+    cat "$1"/* 2> /dev/null | wc -c | tr -d ' '
+}
+
+report() {
+    awk -v b="$1" -v m="$2" -v s="$3" -v n="$4" -v r="$5" -v t="$6" -v i="$7" 'BEGIN {
+        printf "%-14s %-10s %9.2f %9.1fx %9.1f", b, m, s, (n > 0 ? s / n : 0), r / 1048576
+        if (t == "") {
+            printf " %10s %12s\n", "-", "-"
+        } else {
+            printf " %10.1f %12.0f\n", t / 1048576, (i > 0 ? t * 1000000 / i : 0)
+        }
+    }'
+}
+
+selected() {
+    [ -z "$MODES" ] || [[ " $MODES " == *" $1 "* ]]
+}
+
+printf "%-14s %-10s %9s %10s %9s %10s %12s\n" benchmark mode seconds slowdown rss_mb trace_mb bytes/Mins
+
+for bench in "${BENCHMARKS[@]}"; do
+    set -- $bench
+    name=$1
+    shift
+    if [ -n "$ONLY" ] && [[ " $ONLY " != *" $name "* ]]; then
+        continue
+    fi
+    prog=("$OBJ/$name" "$@")
+
+    read native rss <<< "$(best "${prog[@]}")"
+    report $name native "$native" "$native" "$rss"
+
+    read sec rss <<< "$(best $PIN -- "${prog[@]}")"
+    report $name pin "$sec" "$native" "$rss"
+
+    # traced instructions, reported by the tool on its profile run
+    out=$OBJ/out
+    rm -rf $out && mkdir -p $out
+    $PIN -t $TOOL -profile -o $out/profile.txt -- "${prog[@]}" > /dev/null 2>&1
+    instructions=$(awk '/Number of instructions:/ { print $4 }' $out/profile.txt)
+
+    for mode in "${ALL_MODES[@]}"; do
+        modeName=${mode%%|*}
+        options=${mode#*|}
+        if ! selected $modeName; then
+            continue
+        fi
+        rm -rf $out && mkdir -p $out
+        read sec rss <<< "$(best $PIN -t $TOOL $options -o $out/trace -- "${prog[@]}")"
+        report $name $modeName "$sec" "$native" "$rss" "$(traceBytes $out)" "$instructions"
+    done
+done
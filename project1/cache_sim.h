@@ -0,0 +1,334 @@
+/*! @file
+ *  Set-associative cache and TLB simulator fed with the traced accesses.
+ *  A hierarchy has up to MAX_LEVELS cache levels, each filled on a miss, and
+ *  an optional TLB modelled as one more set-associative array whose lines are
+ *  pages. Hits and misses are counted per level and per instruction, so the
+ *  misses can be attributed without hardware counters.
+ */
+
+#ifndef CACHE_SIM_H
+#define CACHE_SIM_H
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <ostream>
+#include <algorithm>
+#include "addr_table.h"
+
+enum ReplacementPolicy {
+    REPLACE_LRU,
+    REPLACE_FIFO,
+    REPLACE_RANDOM
+};
+
+struct CacheConfig {
+    uint64_t size;          // bytes, or entries for a TLB
+    uint32_t assoc;
+    uint32_t lineSize;      // bytes per line, or per page for a TLB
+    ReplacementPolicy policy;
+};
+
+// parse a size with an optional K, M or G suffix
+inline bool parseCacheSize(const std::string& text, uint64_t& size) {
+    std::istringstream sizeStream(text);
+    char unit = 0;
+    if (!(sizeStream >> size)) {
+        return false;
+    }
+    if (sizeStream >> unit) {
+        switch (unit) {
+        case 'K': case 'k': size <<= 10; break;
+        case 'M': case 'm': size <<= 20; break;
+        case 'G': case 'g': size <<= 30; break;
+        default: return false;
+        }
+    }
+    return true;
+}
+
+// parse "size:assoc:line[:policy]", policy being lru (default), fifo or random;
+// with `entries` (a TLB) the size counts entries and the line is a page
+inline bool parseCacheConfig(const std::string& text, CacheConfig& config, bool entries) {
+    std::vector<std::string> fields;
+    std::istringstream fieldStream(text);
+    std::string field;
+    while (std::getline(fieldStream, field, ':')) {
+        fields.push_back(field);
+    }
+    if (fields.size() < 3 || fields.size() > 4) {
+        return false;
+    }
+
+    uint64_t assoc, lineSize;
+    if (!parseCacheSize(fields[0], config.size) || !parseCacheSize(fields[1], assoc) ||
+            !parseCacheSize(fields[2], lineSize)) {
+        return false;
+    }
+    config.assoc = assoc;
+    config.lineSize = lineSize;
+
+    config.policy = REPLACE_LRU;
+    if (fields.size() == 4) {
+        if (fields[3] == "fifo") {
+            config.policy = REPLACE_FIFO;
+        } else if (fields[3] == "random") {
+            config.policy = REPLACE_RANDOM;
+        } else if (fields[3] != "lru") {
+            return false;
+        }
+    }
+
+    // lines must be a power of two and the sets must divide evenly
+    uint64_t setSize = entries ? config.assoc : (uint64_t)config.assoc * config.lineSize;
+    return config.assoc > 0 && config.lineSize > 0 && (config.lineSize & (config.lineSize - 1)) == 0 &&
+        config.size >= setSize && config.size % setSize == 0;
+}
+
+class CacheLevel {
+public:
+    uint64_t accesses;
+    uint64_t misses;
+
+    // `entries` true for a TLB, whose size counts entries rather than bytes
+    CacheLevel(const CacheConfig& config, bool entries)
+        : accesses(0), misses(0), m_config(config), m_lineBits(0), m_tick(0),
+          m_random(0x9e3779b97f4a7c15ULL) {
+        while (((uint64_t)1 << m_lineBits) < config.lineSize) {
+            m_lineBits++;
+        }
+        uint64_t lines = entries ? config.size : config.size / config.lineSize;
+        m_sets = lines / config.assoc;
+        m_tags.assign(m_sets * config.assoc, (uint64_t)EMPTY_TAG);
+        m_stamps.assign(m_sets * config.assoc, 0);
+    }
+
+    const CacheConfig& config() const {
+        return m_config;
+    }
+
+    unsigned lineBits() const {
+        return m_lineBits;
+    }
+
+    // look up the line holding `addr` and fill it on a miss, true on a hit
+    bool access(uint64_t addr) {
+        uint64_t line = addr >> m_lineBits;
+        uint64_t* tags = &m_tags[(line % m_sets) * m_config.assoc];
+        uint64_t* stamps = &m_stamps[(line % m_sets) * m_config.assoc];
+        accesses++;
+        m_tick++;
+
+        uint32_t victim = 0;
+        for (uint32_t way = 0; way < m_config.assoc; way++) {
+            if (tags[way] == line) {
+                if (m_config.policy == REPLACE_LRU) {
+                    stamps[way] = m_tick;
+                }
+                return true;
+            }
+            // empty ways have stamp 0, so they are taken before any filled one
+            if (stamps[way] < stamps[victim]) {
+                victim = way;
+            }
+        }
+
+        misses++;
+        if (m_config.policy == REPLACE_RANDOM && tags[victim] != EMPTY_TAG) {
+            // xorshift, good enough to pick a way
+            m_random ^= m_random << 13;
+            m_random ^= m_random >> 7;
+            m_random ^= m_random << 17;
+            victim = m_random % m_config.assoc;
+        }
+        tags[victim] = line;
+        stamps[victim] = m_tick;
+        return false;
+    }
+
+private:
+    static const uint64_t EMPTY_TAG = ~(uint64_t)0;
+
+    CacheConfig m_config;
+    unsigned m_lineBits;
+    uint64_t m_sets;
+    uint64_t m_tick;
+    uint64_t m_random;
+    std::vector<uint64_t> m_tags;     // line number held by each way, set by set
+    std::vector<uint64_t> m_stamps;   // last use (LRU) or fill (FIFO, random) of each way
+};
+
+class CacheSimulator {
+public:
+    static const unsigned MAX_LEVELS = 4;
+
+    // accesses and misses of one instruction
+    struct InsStats {
+        uint64_t accesses;
+        uint64_t misses[MAX_LEVELS];
+        uint64_t tlbMisses;
+
+        InsStats() : accesses(0), tlbMisses(0) {
+            for (unsigned i = 0; i < MAX_LEVELS; i++) {
+                misses[i] = 0;
+            }
+        }
+
+        // a miss in a lower level is also a miss in every level above, so deeper misses weigh more
+        uint64_t cost() const {
+            uint64_t total = tlbMisses;
+            for (unsigned i = 0; i < MAX_LEVELS; i++) {
+                total += misses[i];
+            }
+            return total;
+        }
+    };
+
+    CacheSimulator() : m_tlb(0) {}
+
+    ~CacheSimulator() {
+        for (size_t i = 0; i < m_levels.size(); i++) {
+            delete m_levels[i];
+        }
+        delete m_tlb;
+    }
+
+    bool enabled() const {
+        return !m_levels.empty() || m_tlb;
+    }
+
+    // add the next cache level below the existing ones, false once MAX_LEVELS exist
+    bool addLevel(const CacheConfig& config) {
+        if (m_levels.size() == MAX_LEVELS) {
+            return false;
+        }
+        m_levels.push_back(new CacheLevel(config, false));
+        return true;
+    }
+
+    void setTlb(const CacheConfig& config) {
+        delete m_tlb;
+        m_tlb = new CacheLevel(config, true);
+    }
+
+    // zero all counts but keep the cached lines, so counting restarts with warm caches
+    void resetCounts() {
+        for (size_t i = 0; i < m_levels.size(); i++) {
+            m_levels[i]->accesses = 0;
+            m_levels[i]->misses = 0;
+        }
+        if (m_tlb) {
+            m_tlb->accesses = 0;
+            m_tlb->misses = 0;
+        }
+        m_ins = AddrTable<InsStats>();
+    }
+
+    // simulate `size` bytes accessed at `ea` by the instruction at `ip`, line by line
+    void access(uint64_t ip, uint64_t ea, uint32_t size) {
+        InsStats& stats = m_ins[ip];
+        stats.accesses++;
+        uint64_t last = ea + (size ? size : 1) - 1;
+
+        if (m_tlb) {
+            unsigned bits = m_tlb->lineBits();
+            for (uint64_t page = ea >> bits; page <= last >> bits; page++) {
+                if (!m_tlb->access(page << bits)) {
+                    stats.tlbMisses++;
+                }
+            }
+        }
+
+        if (m_levels.empty()) {
+            return;
+        }
+        unsigned bits = m_levels[0]->lineBits();
+        for (uint64_t line = ea >> bits; line <= last >> bits; line++) {
+            // go down until a level hits, every level missed is filled
+            for (size_t level = 0; level < m_levels.size(); level++) {
+                if (m_levels[level]->access(line << bits)) {
+                    break;
+                }
+                stats.misses[level]++;
+            }
+        }
+    }
+
+    // print the totals of each level, then the `top` instructions with the most misses;
+    // describe(ip) returns the text printed for an instruction
+    template <typename Describe>
+    void print(std::ostream& out, size_t top, Describe describe) const {
+        for (size_t level = 0; level < m_levels.size(); level++) {
+            printLevel(out, "L" + toString(level + 1), *m_levels[level]);
+        }
+        if (m_tlb) {
+            printLevel(out, "TLB", *m_tlb);
+        }
+
+        std::vector<uint64_t> ips;
+        m_ins.sortedKeys(ips);
+        std::vector<std::pair<uint64_t, uint64_t> > ranked;
+        for (size_t i = 0; i < ips.size(); i++) {
+            uint64_t cost = m_ins.find(ips[i])->cost();
+            if (cost > 0) {
+                ranked.push_back(std::make_pair(cost, ips[i]));
+            }
+        }
+        size_t shown = std::min(top, ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + shown, ranked.end(), byCostDescending);
+
+        out << "===============================================" << std::endl;
+        out << "Instructions with the most misses" << std::endl;
+        out << "===============================================" << std::endl;
+        for (size_t i = 0; i < shown; i++) {
+            printIns(out, ranked[i].second, describe);
+        }
+
+        out << "===============================================" << std::endl;
+        out << "Misses of every instruction by address" << std::endl;
+        out << "===============================================" << std::endl;
+        for (size_t i = 0; i < ips.size(); i++) {
+            printIns(out, ips[i], describe);
+        }
+    }
+
+private:
+    static std::string toString(size_t value) {
+        std::ostringstream stream;
+        stream << value;
+        return stream.str();
+    }
+
+    static bool byCostDescending(const std::pair<uint64_t, uint64_t>& a, const std::pair<uint64_t, uint64_t>& b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    }
+
+    static void printLevel(std::ostream& out, const std::string& name, const CacheLevel& level) {
+        const CacheConfig& config = level.config();
+        static const char* policies[] = { "lru", "fifo", "random" };
+        out << name << " " << config.size << ":" << config.assoc << ":" << config.lineSize << ":"
+            << policies[config.policy] << "  " << level.accesses << " accesses, " << level.misses
+            << " misses (" << (level.accesses ? level.misses * 100.0 / level.accesses : 0.0) << "%)" << std::endl;
+    }
+
+    // "{accesses} accesses, L1 {misses} L2 {misses} .. TLB {misses}  {instruction}"
+    template <typename Describe>
+    void printIns(std::ostream& out, uint64_t ip, Describe describe) const {
+        const InsStats& stats = *m_ins.find(ip);
+        out << std::dec << stats.accesses << " accesses,";
+        for (size_t level = 0; level < m_levels.size(); level++) {
+            out << " L" << level + 1 << " " << stats.misses[level];
+        }
+        if (m_tlb) {
+            out << " TLB " << stats.tlbMisses;
+        }
+        out << "  " << describe(ip);
+    }
+
+    std::vector<CacheLevel*> m_levels;  // L1 first
+    CacheLevel* m_tlb;
+    AddrTable<InsStats> m_ins;          // keyed by instruction address
+};
+
+#endif
@@ -1,2 +1,4 @@
 make obj-intel64/project1.dylib
 cp obj-intel64/project1.dylib bin/project1.dylib
+c++ -O2 -o bin/tracedecode tracedecode.cpp
+c++ -O2 -o bin/tracequery tracequery.cpp
@@ -0,0 +1,236 @@
+/*! @file
+ *  Online stack layout recovery, the automated form of the "Recover the
+ *  Buffer Layout" procedure in the README. Every traced thread keeps a
+ *  FrameTracker with one frame per active call. Each stack access is
+ *  attributed to the frame it falls in, at its offset from the frame's CFA
+ *  (the stack pointer before the call), and votes for a type inferred from
+ *  its size and a few static hints about the instruction. The layouts of all
+ *  calls of a function are merged, so a slot's confidence is the share of its
+ *  accesses that agree with its reported type.
+ */
+
+#ifndef FRAME_LAYOUT_H
+#define FRAME_LAYOUT_H
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <ostream>
+#include "addr_table.h"
+
+enum SlotType {
+    SLOT_CHAR,
+    SLOT_SHORT,
+    SLOT_INT,
+    SLOT_LONG,
+    SLOT_FLOAT,
+    SLOT_DOUBLE,
+    SLOT_VECTOR,
+    SLOT_POINTER,
+    SLOT_SAVED_FP,
+    SLOT_RETURN_ADDR,
+    SLOT_BYTES,
+    SLOT_TYPES
+};
+
+inline const char* slotTypeName(uint32_t type) {
+    static const char* names[SLOT_TYPES] = {
+        "char", "short", "int", "long", "float", "double", "vector",
+        "pointer", "saved rbp", "return address", "bytes"
+    };
+    return names[type];
+}
+
+// static facts about the instruction making an access
+enum AccessHint {
+    HINT_FLOAT = 1,         // reads or writes a floating point register
+    HINT_POINTER = 2,       // the loaded value is used as an address right after
+    HINT_SAVED_FP = 4,      // PUSH rbp / POP rbp
+    HINT_RETURN_ADDR = 8    // RET reading the return address
+};
+
+inline SlotType classifyAccess(uint32_t size, uint32_t hints) {
+    if (hints & HINT_RETURN_ADDR) {
+        return SLOT_RETURN_ADDR;
+    }
+    if (hints & HINT_SAVED_FP) {
+        return SLOT_SAVED_FP;
+    }
+    if (hints & HINT_FLOAT) {
+        return size == 4 ? SLOT_FLOAT : size == 8 ? SLOT_DOUBLE : SLOT_VECTOR;
+    }
+    switch (size) {
+    case 1: return SLOT_CHAR;
+    case 2: return SLOT_SHORT;
+    case 4: return SLOT_INT;
+    case 8: return hints & HINT_POINTER ? SLOT_POINTER : SLOT_LONG;
+    default: return SLOT_BYTES;
+    }
+}
+
+struct SlotStats {
+    uint64_t votes[SLOT_TYPES];
+    uint32_t size;
+
+    SlotStats() : size(0) {
+        for (uint32_t i = 0; i < SLOT_TYPES; i++) {
+            votes[i] = 0;
+        }
+    }
+};
+
+// recovered layout of one function's frame, merged over all its calls
+struct FunctionLayout {
+    uint64_t calls;
+    AddrTable<SlotStats> slots;     // keyed by slotKey(offset from CFA)
+
+    FunctionLayout() : calls(0), slots(64) {}
+
+    // offsets are negative, bias them so no key collides with AddrTable::EMPTY_KEY
+    static uint64_t slotKey(int64_t offset) {
+        return (uint64_t)(offset + ((int64_t)1 << 32));
+    }
+
+    static int64_t slotOffset(uint64_t key) {
+        return (int64_t)key - ((int64_t)1 << 32);
+    }
+
+    void vote(int64_t offset, uint32_t size, SlotType type) {
+        SlotStats& slot = slots[slotKey(offset)];
+        slot.votes[type]++;
+        if (size > slot.size) {
+            slot.size = size;
+        }
+    }
+
+    void merge(const FunctionLayout& other) {
+        calls += other.calls;
+
+        std::vector<uint64_t> keys;
+        other.slots.sortedKeys(keys);
+        for (size_t i = 0; i < keys.size(); i++) {
+            const SlotStats& from = *other.slots.find(keys[i]);
+            SlotStats& to = slots[keys[i]];
+            for (uint32_t t = 0; t < SLOT_TYPES; t++) {
+                to.votes[t] += from.votes[t];
+            }
+            if (from.size > to.size) {
+                to.size = from.size;
+            }
+        }
+    }
+
+    // one line per slot from the top of the frame down: offset, size, type, confidence
+    void print(std::ostream& out) const {
+        std::vector<uint64_t> keys;
+        slots.sortedKeys(keys);
+
+        for (size_t i = keys.size(); i-- > 0;) {
+            const SlotStats& slot = *slots.find(keys[i]);
+            uint64_t total = 0;
+            uint32_t best = 0;
+            for (uint32_t t = 0; t < SLOT_TYPES; t++) {
+                total += slot.votes[t];
+                if (slot.votes[t] > slot.votes[best]) {
+                    best = t;
+                }
+            }
+
+            int64_t offset = slotOffset(keys[i]);
+            out << "    " << (offset < 0 ? "-" : "+") << std::hex << (offset < 0 ? -offset : offset)
+                << " <" << std::dec << slot.size << "> " << slotTypeName(best)
+                << " " << slot.votes[best] * 100 / total << "%"
+                << " (" << total << " accesses)" << std::endl;
+        }
+    }
+};
+
+class FrameTracker {
+public:
+    // accesses further below the innermost CFA are not taken for stack slots
+    static const uint64_t MAX_FRAME = 1 << 20;
+
+    ~FrameTracker() {
+        std::vector<uint64_t> funcs;
+        m_layouts.sortedKeys(funcs);
+        for (size_t i = 0; i < funcs.size(); i++) {
+            delete *m_layouts.find(funcs[i]);
+        }
+    }
+
+    // a function was entered, its return address is stored just below `cfa`
+    void enter(uint64_t func, uint64_t cfa) {
+        // frames left without a RET (longjmp, tail jumps) end where the new one starts
+        while (!m_frames.empty() && m_frames.back().cfa <= cfa) {
+            m_frames.pop_back();
+        }
+
+        FunctionLayout*& layout = m_layouts[func];
+        if (layout == 0) {
+            layout = new FunctionLayout;
+        }
+        layout->calls++;
+
+        Frame frame;
+        frame.cfa = cfa;
+        frame.layout = layout;
+        m_frames.push_back(frame);
+
+        layout->vote(-8, 8, SLOT_RETURN_ADDR);
+    }
+
+    // a RET is about to pop the return address at `sp`
+    void leave(uint64_t sp) {
+        while (!m_frames.empty() && m_frames.back().cfa <= sp + 8) {
+            m_frames.pop_back();
+        }
+    }
+
+    void access(uint64_t ea, uint32_t size, uint32_t hints) {
+        if (m_frames.empty() || ea >= m_frames.front().cfa || ea + MAX_FRAME < m_frames.back().cfa) {
+            return;
+        }
+
+        // frames are ordered by decreasing CFA, the innermost one is the most likely owner
+        size_t i = m_frames.size() - 1;
+        while (ea >= m_frames[i].cfa) {
+            i--;
+        }
+
+        const Frame& frame = m_frames[i];
+        frame.layout->vote((int64_t)(ea - frame.cfa), size, classifyAccess(size, hints));
+    }
+
+    // forget the votes collected so far, the active frames stay
+    void clearLayouts() {
+        std::vector<uint64_t> funcs;
+        m_layouts.sortedKeys(funcs);
+        for (size_t i = 0; i < funcs.size(); i++) {
+            **m_layouts.find(funcs[i]) = FunctionLayout();
+        }
+    }
+
+    // add this thread's layouts to `layouts`, keyed by function address
+    void mergeInto(AddrTable<FunctionLayout*>& layouts) {
+        std::vector<uint64_t> funcs;
+        m_layouts.sortedKeys(funcs);
+        for (size_t i = 0; i < funcs.size(); i++) {
+            FunctionLayout*& merged = layouts[funcs[i]];
+            if (merged == 0) {
+                merged = new FunctionLayout;
+            }
+            merged->merge(**m_layouts.find(funcs[i]));
+        }
+    }
+
+private:
+    struct Frame {
+        uint64_t cfa;
+        FunctionLayout* layout;
+    };
+
+    std::vector<Frame> m_frames;    // outermost first
+    AddrTable<FunctionLayout*> m_layouts;
+};
+
+#endif
@@ -0,0 +1,231 @@
+/*! @file
+ *  Heap allocation tracking. Live allocations are kept in an interval index
+ *  ordered by start address, so an access is attributed to the allocation it
+ *  falls into with one ordered lookup (and none when it hits the same object
+ *  as the previous access). Allocations are grouped by call site, which
+ *  collects their accesses, the share of their bytes ever touched, their
+ *  lifetime in trace order and how many of them were never touched at all.
+ *  Threads hand in their events in runs as they flush, and the runs are merged
+ *  by trace order before they are replayed into the index.
+ */
+
+#ifndef HEAP_TRACKER_H
+#define HEAP_TRACKER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <limits>
+#include <map>
+#include <vector>
+#include <ostream>
+#include <algorithm>
+#include "addr_table.h"
+
+// allocations made from one call site
+struct AllocSite {
+    uint64_t allocations;
+    uint64_t bytes;
+    uint64_t touchedBytes;  // bytes below the highest offset touched, summed over ended allocations
+    uint64_t accesses;
+    uint64_t untouched;     // ended allocations never accessed
+    uint64_t freed;
+    uint64_t lifetime;      // trace order between allocation and free, summed over freed ones
+    uint64_t live;          // allocations alive at exit
+
+    AllocSite() : allocations(0), bytes(0), touchedBytes(0), accesses(0), untouched(0),
+                  freed(0), lifetime(0), live(0) {}
+};
+
+// an allocation, free or access at trace order `time`, queued for replay
+struct HeapEvent {
+    enum Kind { ALLOC, FREE, ACCESS };
+
+    uint64_t time;
+    uint64_t addr;
+    uint64_t site;      // of an allocation
+    uint32_t size;
+    uint32_t kind;
+
+    bool operator<(const HeapEvent& other) const {
+        return time < other.time;
+    }
+};
+
+class HeapTracker {
+public:
+    HeapTracker() : m_last(m_live.end()), m_heapAccesses(0), m_otherAccesses(0), m_runStart(0) {}
+
+    // append an event to the current run, whose events must come in trace order
+    void queue(uint64_t time, uint32_t kind, uint64_t addr, uint32_t size, uint64_t site = 0) {
+        HeapEvent event = { time, addr, site, size, kind };
+        m_pending.push_back(event);
+    }
+
+    // merge the current run into the queued events, then replay those before
+    // trace order `until` and, oldest first, any beyond the `limit` newest
+    void replay(uint64_t until, size_t limit = std::numeric_limits<size_t>::max()) {
+        std::inplace_merge(m_pending.begin(), m_pending.begin() + m_runStart, m_pending.end());
+
+        size_t count = 0;
+        while (count < m_pending.size() && (m_pending[count].time < until || m_pending.size() - count > limit)) {
+            const HeapEvent& event = m_pending[count++];
+            if (event.kind == HeapEvent::ALLOC) {
+                allocate(event.site, event.addr, event.size, event.time);
+            } else if (event.kind == HeapEvent::FREE) {
+                release(event.addr, event.time);
+            } else {
+                access(event.addr, event.size);
+            }
+        }
+        m_pending.erase(m_pending.begin(), m_pending.begin() + count);
+        m_runStart = m_pending.size();
+    }
+
+    // `size` bytes at `start` were allocated from `site` at trace order `time`
+    void allocate(uint64_t site, uint64_t start, uint64_t size, uint64_t time) {
+        // an allocation still recorded at this address was freed untracked
+        release(start, time);
+
+        Allocation& alloc = m_live[start];
+        alloc.size = size;
+        alloc.site = site;
+        alloc.time = time;
+        alloc.accesses = 0;
+        alloc.extent = 0;
+
+        AllocSite& stats = m_sites[site];
+        stats.allocations++;
+        stats.bytes += size;
+    }
+
+    // the allocation at `start` was freed at trace order `time`, unknown addresses are ignored
+    void release(uint64_t start, uint64_t time) {
+        LiveMap::iterator it = m_live.find(start);
+        if (it == m_live.end()) {
+            return;
+        }
+
+        AllocSite& stats = end(it->second);
+        stats.freed++;
+        stats.lifetime += time - it->second.time;
+
+        if (m_last == it) {
+            m_last = m_live.end();
+        }
+        m_live.erase(it);
+    }
+
+    // attribute an access to the live allocation containing `ea`, if any
+    bool access(uint64_t ea, uint32_t size) {
+        if (m_last == m_live.end() || ea < m_last->first || ea >= m_last->first + m_last->second.size) {
+            LiveMap::iterator it = m_live.upper_bound(ea);
+            if (it == m_live.begin() || ea >= (--it)->first + it->second.size) {
+                m_otherAccesses++;
+                return false;
+            }
+            m_last = it;
+        }
+
+        Allocation& alloc = m_last->second;
+        alloc.accesses++;
+        uint64_t extent = std::min(ea - m_last->first + size, alloc.size);
+        alloc.extent = std::max(alloc.extent, extent);
+        m_sites[alloc.site].accesses++;
+        m_heapAccesses++;
+        return true;
+    }
+
+    // restart the statistics, live allocations count as made again by their sites
+    void resetCounts() {
+        m_sites = AddrTable<AllocSite>();
+        m_heapAccesses = 0;
+        m_otherAccesses = 0;
+        for (LiveMap::iterator it = m_live.begin(); it != m_live.end(); ++it) {
+            it->second.accesses = 0;
+            it->second.extent = 0;
+            AllocSite& stats = m_sites[it->second.site];
+            stats.allocations++;
+            stats.bytes += it->second.size;
+        }
+    }
+
+    // end the allocations still alive, before printing
+    void finish() {
+        for (LiveMap::iterator it = m_live.begin(); it != m_live.end(); ++it) {
+            end(it->second).live++;
+        }
+        m_live.clear();
+        m_last = m_live.end();
+    }
+
+    // print the totals, then every call site by accesses, most accessed first;
+    // describe(site) returns the text printed for a call site
+    template <typename Describe>
+    void print(std::ostream& out, Describe describe) const {
+        std::vector<uint64_t> sites;
+        m_sites.sortedKeys(sites);
+
+        uint64_t allocations = 0;
+        uint64_t bytes = 0;
+        std::vector<std::pair<uint64_t, uint64_t> > ranked;
+        for (size_t i = 0; i < sites.size(); i++) {
+            const AllocSite& stats = *m_sites.find(sites[i]);
+            allocations += stats.allocations;
+            bytes += stats.bytes;
+            ranked.push_back(std::make_pair(stats.accesses, sites[i]));
+        }
+        std::sort(ranked.begin(), ranked.end(), byAccessesDescending);
+
+        out << std::dec << allocations << " allocations of " << bytes << " bytes from "
+            << sites.size() << " sites, " << m_heapAccesses << " accesses to the heap, "
+            << m_otherAccesses << " elsewhere" << std::endl;
+        out << "===============================================" << std::endl;
+        out << "Allocation sites by accesses" << std::endl;
+        out << "===============================================" << std::endl;
+
+        for (size_t i = 0; i < ranked.size(); i++) {
+            const AllocSite& stats = *m_sites.find(ranked[i].second);
+            out << std::dec << stats.accesses << " accesses, "
+                << stats.allocations << " allocations of " << stats.bytes << " bytes, "
+                << stats.untouched << " never touched, "
+                << (stats.bytes ? stats.touchedBytes * 100 / stats.bytes : 0) << "% of bytes touched, "
+                << "lifetime " << (stats.freed ? stats.lifetime / stats.freed : 0) << ", "
+                << stats.live << " live at exit  " << describe(ranked[i].second);
+        }
+    }
+
+private:
+    struct Allocation {
+        uint64_t size;
+        uint64_t site;
+        uint64_t time;
+        uint64_t accesses;
+        uint64_t extent;    // highest offset touched, plus one
+    };
+
+    typedef std::map<uint64_t, Allocation> LiveMap;
+
+    static bool byAccessesDescending(const std::pair<uint64_t, uint64_t>& a, const std::pair<uint64_t, uint64_t>& b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    }
+
+    // fold an allocation that ends into its site
+    AllocSite& end(const Allocation& alloc) {
+        AllocSite& stats = m_sites[alloc.site];
+        stats.touchedBytes += alloc.extent;
+        if (alloc.accesses == 0) {
+            stats.untouched++;
+        }
+        return stats;
+    }
+
+    LiveMap m_live;                 // live allocations by start address
+    LiveMap::iterator m_last;       // allocation of the previous access, or m_live.end()
+    AddrTable<AllocSite> m_sites;   // keyed by call site
+    uint64_t m_heapAccesses;
+    uint64_t m_otherAccesses;
+    std::vector<HeapEvent> m_pending;   // queued events by trace order, then the current run
+    size_t m_runStart;
+};
+
+#endif
@@ -7,6 +7,17 @@
 #include "pin.H"
 #include <iostream>
 #include <fstream>
+#include "trace_format.h"
+#include "trace_codec.h"
+#include "addr_table.h"
+#include "shadow_memory.h"
+#include "frame_layout.h"
+#include "cache_sim.h"
+#include "reuse_distance.h"
+#include "heap_tracker.h"
+#include "taint_memory.h"
+#include "trace_flow.h"
+#include <sys/syscall.h>
 
 /* ================================================================== */
 // Global variables
@@ -32,147 +43,1982 @@ KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE,  "pintool",
 KNOB<BOOL>   KnobCount(KNOB_MODE_WRITEONCE,  "pintool",
     "count", "1", "count instructions, basic blocks and threads in the application");
 
+KNOB<BOOL>   KnobBinary(KNOB_MODE_WRITEONCE,  "pintool",
+    "binary", "0", "write the trace as binary records (see trace_format.h) instead of text, requires -o");
+
+KNOB<BOOL>   KnobStream(KNOB_MODE_WRITEONCE,  "pintool",
+    "stream", "0", "stream binary records to the -o file while the application runs, with bounded memory");
+
+KNOB<BOOL>   KnobCompress(KNOB_MODE_WRITEONCE,  "pintool",
+    "compress", "0", "compress the records of -binary and -stream traces, see trace_codec.h");
+
+KNOB<BOOL>   KnobFlow(KNOB_MODE_WRITEONCE,  "pintool",
+    "flow", "0", "print the records in execution order with blocks, loops and the call tree instead of grouped by instruction");
+
+KNOB<BOOL>   KnobRanges(KNOB_MODE_WRITEONCE,  "pintool",
+    "ranges", "0", "list accessed memory as coalesced contiguous ranges instead of one line per address");
+
+KNOB<BOOL>   KnobValues(KNOB_MODE_WRITEONCE,  "pintool",
+    "values", "0", "capture the values read and written by the traced instructions");
+
+KNOB<string> KnobValueRange(KNOB_MODE_APPEND,  "pintool",
+    "value_range", "", "only capture memory values inside the hex range lo:hi, may be repeated");
+
+KNOB<string> KnobValueClass(KNOB_MODE_APPEND,  "pintool",
+    "value_class", "", "only capture values of instructions in this category (e.g. DATAXFER, SSE), may be repeated");
+
+KNOB<BOOL>   KnobValueRegs(KNOB_MODE_WRITEONCE,  "pintool",
+    "value_regs", "1", "with -values, also capture the written general purpose registers");
+
+KNOB<string> KnobLayout(KNOB_MODE_WRITEONCE,  "pintool",
+    "layout", "", "recover the stack frame layout of every traced function into this file");
+
+KNOB<string> KnobFunc(KNOB_MODE_APPEND,  "pintool",
+    "func", "", "only trace the function with this symbol name, may be repeated");
+
+KNOB<string> KnobRange(KNOB_MODE_APPEND,  "pintool",
+    "range", "", "only trace instructions inside the hex range lo:hi, may be repeated");
+
+KNOB<string> KnobLib(KNOB_MODE_APPEND,  "pintool",
+    "lib", "", "also trace the shared library whose path contains this string, may be repeated");
+
+KNOB<BOOL>   KnobProfile(KNOB_MODE_WRITEONCE,  "pintool",
+    "profile", "0", "only count block executions and report the hot blocks, without tracing");
+
+KNOB<UINT32> KnobHot(KNOB_MODE_WRITEONCE,  "pintool",
+    "hot", "20", "number of hot blocks, and of instructions with the most cache misses, reported");
+
+KNOB<string> KnobCache(KNOB_MODE_APPEND,  "pintool",
+    "cache", "", "simulate a cache level size:assoc:line[:lru|fifo|random], repeat for L2, L3..");
+
+KNOB<string> KnobTlb(KNOB_MODE_WRITEONCE,  "pintool",
+    "tlb", "", "simulate a TLB entries:assoc:page[:lru|fifo|random]");
+
+KNOB<string> KnobCacheOut(KNOB_MODE_WRITEONCE,  "pintool",
+    "cache_out", "", "write the cache simulation report to this file instead of stderr");
+
+KNOB<string> KnobReuse(KNOB_MODE_WRITEONCE,  "pintool",
+    "reuse", "", "write reuse distance histograms and working sets of the traced accesses to this file");
+
+KNOB<UINT32> KnobReuseLine(KNOB_MODE_WRITEONCE,  "pintool",
+    "reuse_line", "64", "line size in bytes the reuse distance is measured in");
+
+KNOB<UINT32> KnobWindow(KNOB_MODE_WRITEONCE,  "pintool",
+    "window", "100000", "number of line accesses in each working set window");
+
+KNOB<string> KnobHeap(KNOB_MODE_WRITEONCE,  "pintool",
+    "heap", "", "track heap allocations, attribute accesses to them and write allocation sites to this file");
+
+KNOB<string> KnobTaint(KNOB_MODE_WRITEONCE,  "pintool",
+    "taint", "", "propagate taint from input syscalls and marked buffers, write the instructions reading tainted data to this file");
+
+KNOB<string> KnobTaintFd(KNOB_MODE_APPEND,  "pintool",
+    "taint_fd", "", "with -taint, only taint data read from this file descriptor, may be repeated");
+
+KNOB<string> KnobTaintRange(KNOB_MODE_APPEND,  "pintool",
+    "taint_range", "", "with -taint, taint the memory in the hex range lo:hi at start, may be repeated");
+
+KNOB<string> KnobTaintMark(KNOB_MODE_APPEND,  "pintool",
+    "taint_mark", "", "with -taint, calls to this function f(buf, size) taint the buffer, may be repeated");
+
+KNOB<UINT32> KnobDetachSec(KNOB_MODE_WRITEONCE,  "pintool",
+    "detach_sec", "0", "detach from the application after this many seconds and write the results");
+
+KNOB<UINT64> KnobDetachIns(KNOB_MODE_WRITEONCE,  "pintool",
+    "detach_ins", "0", "detach from the application after about this many traced instructions");
+
+KNOB<string> KnobSuffix(KNOB_MODE_WRITEONCE,  "pintool",
+    "suffix", "", "appended to every output file name, set for the processes an exec starts");
+
+KNOB<UINT32> KnobSample(KNOB_MODE_WRITEONCE,  "pintool",
+    "sample", "1", "only record one in this many executions of each instruction");
+
+KNOB<string> KnobBurst(KNOB_MODE_WRITEONCE,  "pintool",
+    "burst", "", "record in bursts of on:off instructions, tracing `on` and skipping `off` in turn");
+
 
 /* ===================================================================== */
 // Utilities
 /* ===================================================================== */
 
-/*!
- *  Print out help message.
- */
-INT32 Usage() {
-    cerr << "This tool prints out the number of dynamically executed " << endl <<
-            "instructions, basic blocks and threads in the application." << endl << endl;
+/*!
+ *  Print out help message.
+ */
+INT32 Usage() {
+    cerr << "This tool prints out the number of dynamically executed " << endl <<
+            "instructions, basic blocks and threads in the application." << endl << endl;
+
+    cerr << KNOB_BASE::StringKnobSummary() << endl;
+
+    return -1;
+}
+
+// appended to the output file names, grows with each fork and exec
+string outputSuffix;
+
+// name of an output file of this process
+string OutputName(const string& name) {
+    return name + outputSuffix;
+}
+
+// the non-empty values given to a knob which may be repeated
+vector<string> AppendedValues(KNOB<string>& knob) {
+    vector<string> values;
+    for (UINT32 i = 0; i < knob.NumberOfValues(); i++) {
+        if (!knob.Value(i).empty()) {
+            values.push_back(knob.Value(i));
+        }
+    }
+    return values;
+}
+
+// half-open address range [first, second)
+typedef std::pair<ADDRINT, ADDRINT> AddrRange;
+
+BOOL InRanges(const vector<AddrRange>& ranges, ADDRINT addr) {
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (ranges[i].first <= addr && addr < ranges[i].second) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// parse a hex address range "lo:hi"
+BOOL ParseRange(const string& text, ADDRINT& low, ADDRINT& high) {
+    size_t colon = text.find(':');
+    if (colon == string::npos) {
+        return FALSE;
+    }
+
+    std::istringstream lowStream(text.substr(0, colon));
+    std::istringstream highStream(text.substr(colon + 1));
+    return (lowStream >> std::hex >> low) && (highStream >> std::hex >> high) && low <= high;
+}
+
+// static log of an instruction, decoded once when it is first instrumented
+struct InsLog {
+    std::string text;       // address, name and registers, as printed
+    UINT32 flags;           // TraceInsFlags
+    std::string mnemonic;
+    vector<REG> readRegs;
+    vector<REG> writeRegs;
+    BOOL readsFloat;
+    BOOL writesFloat;
+};
+
+// table to hold the static log for each instruction
+AddrTable<InsLog> insLogs;
+
+// instructions of a basic block, recorded by a single call if none accesses memory
+struct BlockLog {
+    vector<ADDRINT> ips;
+    ADDRINT end;            // address after the last instruction
+    UINT32 id;              // index of the block's execution counter
+    string func;            // name of the enclosing routine, for the hot block report
+};
+
+// blocks keyed by head address and instruction count, so re-instrumenting reuses them
+std::map<std::pair<ADDRINT, UINT32>, BlockLog*> blockLogs;
+
+// every block by id
+vector<BlockLog*> blockList;
+
+// executions of each block by id, merged from the threads as they exit
+vector<UINT64> blockCounts;
+
+// flat buffer holding every execution record, formatted only in Fini
+vector<TraceRecord> traceRecords;
+
+// one REC chunk for each merged thread buffer, to keep the thread of the records
+vector<TraceChunkHeader> traceChunks;
+
+// order to track the how the instructions are processed, shared by all threads
+volatile UINT64 order = 0;
+
+// a util shadow memory to recover mem easier, record all mem access
+ShadowMemory memSet;
+
+// protects insLogs, traceRecords and memSet, which are shared by all threads
+PIN_LOCK logLock;
+
+// how the records are sampled, from -sample and -burst
+TraceSampling sampling;
+
+// caches simulated with the accesses of every flushed buffer, protected by cacheLock
+CacheSimulator cacheSim;
+PIN_LOCK cacheLock;
+
+// reuse distances of the accesses of every flushed buffer with -reuse, protected by reuseLock
+ReuseProfiler* reuseProfiler = 0;
+PIN_LOCK reuseLock;
+
+// live allocations and allocation sites with -heap, protected by heapLock
+HeapTracker heapTracker;
+PIN_LOCK heapLock;
+
+
+/* ===================================================================== */
+// Per-thread trace buffers
+/* ===================================================================== */
+
+// number of executions a thread buffers before merging them into traceRecords
+const UINT32 BUFFER_ENTRIES = 4096;
+
+// entries left free by block reservations for the events appended inside a
+// block, at most a realloc's FREE and ALLOC at the allocator's return
+const UINT32 EVENT_HEADROOM = 2;
+
+// fixed-size trace buffers owned by a single thread, so recording needs no lock.
+// Records go to `entries`; in streaming mode the thread switches to its other
+// buffer while the full one is written out by the writer thread.
+struct ThreadLog {
+    TraceRecord* entries;
+    UINT32 count;
+    THREADID tid;
+    UINT32 current;
+    TraceRecord buffers[2][BUFFER_ENTRIES];
+    PIN_SEMAPHORE bufferFree[2];
+
+    // memory write whose value is captured after the instruction
+    ADDRINT pendingAddr;
+    UINT32 pendingSize;
+    UINT64 pendingSeq;
+
+    // active frames of this thread, with -layout
+    FrameTracker* frames;
+
+    // whether the current block is recorded, always TRUE without sampling
+    BOOL sampled;
+    // instructions left in the current burst or gap, and executed in traced code so far
+    INT64 burstLeft;
+    UINT64 executed;
+
+    // executions of each block by id, grown when a new block runs first in this thread
+    UINT64* blockCounts;
+    UINT32 blockCap;
+
+    // executions of each block by id until it is recorded again, with -sample
+    UINT32* sampleLeft;
+    UINT32 sampleCap;
+
+    // instructions not yet added to detachCount, with -detach_ins
+    UINT64 detachBatch;
+
+    // allocator call in progress with -heap and the stack pointer at its entry, 0 if none.
+    // Calls made deeper on the stack by the allocator itself are nested.
+    ADDRINT allocSp;
+    ADDRINT allocKind;
+    ADDRINT allocSite;
+    ADDRINT allocSize;
+    ADDRINT allocOld;
+
+    // tainted bytes of each full register as a mask, and how many registers have any, with -taint
+    UINT64* regTaint;
+    UINT32 taintedRegs;
+    // input syscall in progress, its buffer is tainted when it returns
+    BOOL taintInput;
+    ADDRINT taintFd;
+    ADDRINT taintBuf;
+};
+
+// each thread's ThreadLog is kept in TLS and in a tool register for fast access
+TLS_KEY tlsKey;
+REG scratchReg;
+
+// ThreadLogs of the running threads, protected by logLock
+vector<ThreadLog*> threadLogs;
+
+// merge the buffered executions of a thread into the shared records
+VOID MergeThreadLog(ThreadLog* tl) {
+    PIN_GetLock(&logLock, tl->tid + 1);
+
+    TraceChunkHeader chunk;
+    chunk.type = TRACE_CHUNK_REC;
+    chunk.tid = tl->tid;
+    chunk.count = tl->count;
+    chunk.bytes = tl->count * sizeof(TraceRecord);
+    traceChunks.push_back(chunk);
+
+    traceRecords.insert(traceRecords.end(), tl->entries, tl->entries + tl->count);
+
+    for (UINT32 i = 0; i < tl->count; i++) {
+        const TraceRecord& rec = tl->entries[i];
+        if (isMemAccess(rec)) {
+            memSet.record(rec.ea, rec.size);
+        }
+    }
+    PIN_ReleaseLock(&logLock);
+}
+
+
+/* ===================================================================== */
+// Streaming writer
+/* ===================================================================== */
+
+// a full thread buffer waiting for the writer thread
+struct PendingBuffer {
+    ThreadLog* tl;
+    UINT32 index;
+    UINT32 count;
+};
+
+// how long the writer sleeps before picking up new instructions anyway
+const UINT32 WRITER_PERIOD_MS = 100;
+
+// full buffers handed to the writer, protected by queueLock
+vector<PendingBuffer> writeQueue;
+PIN_LOCK queueLock;
+PIN_SEMAPHORE queueReady;
+
+// instructions whose static logs are not streamed yet, protected by logLock
+vector<uint64_t> newIns;
+
+// held by the writer while it writes, so a fork never copies a half written stream
+PIN_LOCK outLock;
+
+PIN_THREAD_UID writerUid;
+volatile BOOL writerRunning = FALSE;
+volatile BOOL writerExit = FALSE;
+
+VOID WriteTraceHeader() {
+    TraceFileHeader header;
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    out->write((const char*)&header, sizeof(header));
+
+    if (sampling.period > 1 || sampling.burstOn > 0) {
+        TraceChunkHeader chunk;
+        chunk.type = TRACE_CHUNK_SAMPLING;
+        chunk.tid = 0;
+        chunk.count = 1;
+        chunk.bytes = sizeof(sampling);
+        out->write((const char*)&chunk, sizeof(chunk));
+        out->write((const char*)&sampling, sizeof(sampling));
+    }
+}
+
+// serialize the static logs of the given instructions as one INS chunk, caller holds logLock
+std::string EncodeInsChunk(const vector<uint64_t>& addrs) {
+    std::string payload;
+    for (size_t i = 0; i < addrs.size(); i++) {
+        const InsLog& insLog = insLogs[addrs[i]];
+
+        TraceInsEntry entry;
+        entry.addr = addrs[i];
+        entry.flags = insLog.flags;
+        entry.textLen = insLog.text.size();
+        payload.append((const char*)&entry, sizeof(entry));
+        payload += insLog.text;
+    }
+
+    TraceChunkHeader chunk;
+    chunk.type = TRACE_CHUNK_INS;
+    chunk.tid = 0;
+    chunk.count = addrs.size();
+    chunk.bytes = payload.size();
+    return std::string((const char*)&chunk, sizeof(chunk)) + payload;
+}
+
+VOID WriteRecChunk(THREADID tid, const TraceRecord* records, UINT32 count) {
+    TraceChunkHeader chunk;
+    chunk.tid = tid;
+    chunk.count = count;
+
+    if (KnobCompress) {
+        std::string payload = compressRecords(records, count);
+        chunk.type = TRACE_CHUNK_ZREC;
+        chunk.bytes = payload.size();
+        out->write((const char*)&chunk, sizeof(chunk));
+        out->write(payload.data(), payload.size());
+        return;
+    }
+
+    chunk.type = TRACE_CHUNK_REC;
+    chunk.bytes = count * sizeof(TraceRecord);
+    out->write((const char*)&chunk, sizeof(chunk));
+    out->write((const char*)records, chunk.bytes);
+}
+
+// write the static logs of instructions instrumented since the last call
+VOID WriteNewIns() {
+    PIN_GetLock(&logLock, PIN_ThreadId() + 1);
+    std::string chunk;
+    if (!newIns.empty()) {
+        chunk = EncodeInsChunk(newIns);
+        newIns.clear();
+    }
+    PIN_ReleaseLock(&logLock);
+
+    out->write(chunk.data(), chunk.size());
+}
+
+// background thread draining full thread buffers to the output file
+VOID WriterThread(VOID *arg) {
+    for (;;) {
+        PIN_SemaphoreTimedWait(&queueReady, WRITER_PERIOD_MS);
+        PIN_SemaphoreClear(&queueReady);
+
+        PIN_GetLock(&outLock, PIN_ThreadId() + 1);
+        WriteNewIns();
+
+        vector<PendingBuffer> batch;
+        PIN_GetLock(&queueLock, PIN_ThreadId() + 1);
+        if (writeQueue.empty() && writerExit) {
+            // from now on the application threads write their buffers themselves
+            writerRunning = FALSE;
+            PIN_ReleaseLock(&queueLock);
+            PIN_ReleaseLock(&outLock);
+            break;
+        }
+        batch.swap(writeQueue);
+        PIN_ReleaseLock(&queueLock);
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            PendingBuffer& pending = batch[i];
+            WriteRecChunk(pending.tl->tid, pending.tl->buffers[pending.index], pending.count);
+            PIN_SemaphoreSet(&pending.tl->bufferFree[pending.index]);
+        }
+        out->flush();
+        PIN_ReleaseLock(&outLock);
+    }
+}
+
+// start the writer thread of a streamed trace, FALSE if Pin cannot
+BOOL StartWriter() {
+    PIN_SemaphoreInit(&queueReady);
+    writerExit = FALSE;
+    writerRunning = TRUE;
+    return PIN_SpawnInternalThread(WriterThread, 0, 0, &writerUid) != INVALID_THREADID;
+}
+
+// hand the full buffer of a thread to the writer and continue in the other one
+VOID StreamThreadLog(ThreadLog* tl) {
+    PIN_GetLock(&queueLock, tl->tid + 1);
+    if (writerRunning) {
+        PIN_SemaphoreClear(&tl->bufferFree[tl->current]);
+
+        PendingBuffer pending;
+        pending.tl = tl;
+        pending.index = tl->current;
+        pending.count = tl->count;
+        writeQueue.push_back(pending);
+        PIN_ReleaseLock(&queueLock);
+        PIN_SemaphoreSet(&queueReady);
+
+        // this only waits when the writer is a whole buffer behind
+        tl->current ^= 1;
+        PIN_SemaphoreWait(&tl->bufferFree[tl->current]);
+        tl->entries = tl->buffers[tl->current];
+    } else {
+        // the writer has stopped at exit, write the buffer from this thread
+        WriteRecChunk(tl->tid, tl->entries, tl->count);
+        PIN_ReleaseLock(&queueLock);
+    }
+}
+
+// stop the writer before Pin terminates the application threads
+VOID PrepareForFini(VOID *v) {
+    writerExit = TRUE;
+    PIN_SemaphoreSet(&queueReady);
+    PIN_WaitForThreadTermination(writerUid, PIN_INFINITE_TIMEOUT, 0);
+}
+
+// run the buffered accesses of a thread through the simulated caches, in execution order
+VOID SimulateCache(ThreadLog* tl) {
+    PIN_GetLock(&cacheLock, tl->tid + 1);
+    for (UINT32 i = 0; i < tl->count; i++) {
+        const TraceRecord& rec = tl->entries[i];
+        if (isMemAccess(rec)) {
+            cacheSim.access(rec.ip, rec.ea, rec.size);
+        }
+    }
+    PIN_ReleaseLock(&cacheLock);
+}
+
+// measure the reuse distances of the buffered accesses of a thread, in execution order
+VOID ProfileReuse(ThreadLog* tl) {
+    PIN_GetLock(&reuseLock, tl->tid + 1);
+    for (UINT32 i = 0; i < tl->count; i++) {
+        const TraceRecord& rec = tl->entries[i];
+        if (isMemAccess(rec)) {
+            reuseProfiler->access(rec.ip, rec.ea, rec.size);
+        }
+    }
+    PIN_ReleaseLock(&reuseLock);
+}
+
+// heap events held back for threads that have not flushed, before the oldest are replayed anyway
+const size_t HEAP_PENDING_LIMIT = 64 * BUFFER_ENTRIES;
+
+// the lowest trace order the threads other than `tl` may still hand to TrackHeap:
+// the first of each one's buffered records, or the next order for an empty buffer.
+// The order is read first, so a thread starting to record after the read gets a later one.
+UINT64 HeapWatermark(ThreadLog* tl) {
+    UINT64 watermark = __sync_fetch_and_add(&order, 0);
+    PIN_GetLock(&logLock, tl->tid + 1);
+    for (size_t i = 0; i < threadLogs.size(); i++) {
+        ThreadLog* other = threadLogs[i];
+        if (other != tl && *(volatile UINT32*)&other->count > 0) {
+            UINT64 first = ((volatile TraceRecord*)other->entries)->seq;
+            watermark = first < watermark ? first : watermark;
+        }
+    }
+    PIN_ReleaseLock(&logLock);
+    return watermark;
+}
+
+// queue the allocations, frees and accesses of a thread buffer, then replay the
+// events of all threads in execution order up to where every thread has flushed
+VOID TrackHeap(ThreadLog* tl) {
+    UINT64 watermark = HeapWatermark(tl);
+
+    PIN_GetLock(&heapLock, tl->tid + 1);
+    for (UINT32 i = 0; i < tl->count; i++) {
+        const TraceRecord& rec = tl->entries[i];
+        if (rec.rw == TRACE_ALLOC) {
+            heapTracker.queue(rec.seq, HeapEvent::ALLOC, rec.ea, rec.size, rec.ip);
+        } else if (rec.rw == TRACE_FREE) {
+            heapTracker.queue(rec.seq, HeapEvent::FREE, rec.ea, 0);
+        } else if (isMemAccess(rec)) {
+            heapTracker.queue(rec.seq, HeapEvent::ACCESS, rec.ea, rec.size);
+        }
+    }
+    heapTracker.replay(watermark, HEAP_PENDING_LIMIT);
+    PIN_ReleaseLock(&heapLock);
+}
+
+VOID FlushThreadLog(ThreadLog* tl) {
+    if (tl->count == 0) {
+        return;
+    }
+
+    if (cacheSim.enabled()) {
+        SimulateCache(tl);
+    }
+    if (reuseProfiler) {
+        ProfileReuse(tl);
+    }
+    if (!KnobHeap.Value().empty()) {
+        TrackHeap(tl);
+    }
+
+    if (KnobStream) {
+        StreamThreadLog(tl);
+    } else {
+        MergeThreadLog(tl);
+    }
+
+    tl->count = 0;
+}
+
+// take the next global order and append the execution to the thread buffer,
+// which always has room as BufferFull is checked before the block
+inline VOID AppendAccess(ThreadLog* tl, ADDRINT ip, UINT32 rw, ADDRINT addr, UINT32 size) {
+    TraceRecord& rec = tl->entries[tl->count++];
+    rec.seq = __sync_fetch_and_add(&order, 1);
+    rec.ip = ip;
+    rec.ea = addr;
+    rec.size = size;
+    rec.rw = rw;
+}
+
+// inserted as the if-call before every block, true if the block's records may not
+// fit next to the headroom kept for events
+ADDRINT BufferFull(ThreadLog* tl, UINT32 records) {
+    return tl->count + records > BUFFER_ENTRIES - EVENT_HEADROOM;
+}
+
+// inserted for instructions which read memory
+VOID RecordMemRead(ThreadLog* tl, ADDRINT ip, ADDRINT addr, UINT32 size) {
+    AppendAccess(tl, ip, TRACE_READ, addr, size);
+}
+
+// inserted for instructions which write memory
+VOID RecordMemWrite(ThreadLog* tl, ADDRINT ip, ADDRINT addr, UINT32 size) {
+    AppendAccess(tl, ip, TRACE_WRITE, addr, size);
+}
+
+// inserted for instruction which do not access memory
+VOID RecordNoMemAccess(ThreadLog* tl, ADDRINT ip) {
+    AppendAccess(tl, ip, TRACE_NO_MEM, 0, 0);
+}
+
+/* ===================================================================== */
+// Value capture
+/* ===================================================================== */
+
+// memory values are only captured inside these ranges, if any
+vector<AddrRange> valueRanges;
+
+// categories of instructions whose values are captured, if any
+vector<string> valueClasses;
+
+BOOL CapturesAddr(ADDRINT addr) {
+    return valueRanges.empty() || InRanges(valueRanges, addr);
+}
+
+// append a value record carrying the seq of the access it belongs to
+inline VOID AppendValue(ThreadLog* tl, ADDRINT ip, UINT64 seq, UINT32 rw, UINT64 value, UINT32 size) {
+    TraceRecord& rec = tl->entries[tl->count++];
+    rec.seq = seq;
+    rec.ip = ip;
+    rec.ea = value;
+    rec.size = size;
+    rec.rw = rw;
+}
+
+// append the first (up to 8) bytes at addr as a memory value
+VOID AppendMemValue(ThreadLog* tl, ADDRINT ip, UINT64 seq, ADDRINT addr, UINT32 size) {
+    UINT64 value = 0;
+    UINT32 captured = size < sizeof(value) ? size : sizeof(value);
+    captured = PIN_SafeCopy(&value, (const VOID*)addr, captured);
+    AppendValue(tl, ip, seq, TRACE_MEM_VALUE, value, captured);
+}
+
+// inserted before instructions which read memory, when their values are captured
+VOID RecordMemReadValue(ThreadLog* tl, ADDRINT ip, ADDRINT addr, UINT32 size) {
+    AppendAccess(tl, ip, TRACE_READ, addr, size);
+
+    if (CapturesAddr(addr)) {
+        AppendMemValue(tl, ip, tl->entries[tl->count - 1].seq, addr, size);
+    }
+}
+
+// inserted before instructions which write memory, the value is read after them
+VOID RecordMemWriteValue(ThreadLog* tl, ADDRINT ip, ADDRINT addr, UINT32 size) {
+    AppendAccess(tl, ip, TRACE_WRITE, addr, size);
+
+    tl->pendingAddr = addr;
+    tl->pendingSize = CapturesAddr(addr) ? size : 0;
+    tl->pendingSeq = tl->entries[tl->count - 1].seq;
+}
+
+// inserted after instructions which write memory
+VOID CaptureWrittenMem(ThreadLog* tl, ADDRINT ip) {
+    if (tl->pendingSize > 0) {
+        AppendMemValue(tl, ip, tl->pendingSeq, tl->pendingAddr, tl->pendingSize);
+        tl->pendingSize = 0;
+    }
+}
+
+// inserted after instructions which write general purpose registers
+VOID CaptureRegValue(ThreadLog* tl, ADDRINT ip, UINT32 index, ADDRINT value) {
+    // the instruction's own records are the last ones in the buffer
+    AppendValue(tl, ip, tl->entries[tl->count - 1].seq, TRACE_REG_VALUE, value, index);
+}
+
+/* ===================================================================== */
+// Stack layout recovery
+/* ===================================================================== */
+
+// layouts of all threads merged at thread exit, keyed by function address, protected by logLock
+AddrTable<FunctionLayout*> frameLayouts;
+
+// names of the traced functions, keyed by address, protected by logLock
+AddrTable<string> functionNames;
+
+// inserted at the entry of traced functions, where the stack pointer points to the return address
+VOID EnterFrame(ThreadLog* tl, ADDRINT func, ADDRINT sp) {
+    tl->frames->enter(func, sp + sizeof(ADDRINT));
+}
+
+// inserted before RET
+VOID LeaveFrame(ThreadLog* tl, ADDRINT sp) {
+    tl->frames->leave(sp);
+}
+
+// inserted for each memory operand of the traced instructions
+VOID FrameAccess(ThreadLog* tl, ADDRINT addr, UINT32 size, UINT32 hints) {
+    tl->frames->access(addr, size, hints);
+}
+
+/* ===================================================================== */
+// Sampling
+/* ===================================================================== */
+
+BOOL Sampling() {
+    return sampling.period > 1 || sampling.burstOn > 0;
+}
+
+// inserted as the if-call before every record call when sampling
+ADDRINT IsSampled(ThreadLog* tl) {
+    return tl->sampled;
+}
+
+// inserted as the if-call before every block with -sample, true if the thread has no
+// countdown for it yet
+ADDRINT SampleCountsFull(ThreadLog* tl, UINT32 id) {
+    return id >= tl->sampleCap;
+}
+
+// new blocks start a full period before their first record
+VOID GrowSampleCounts(ThreadLog* tl, UINT32 id) {
+    UINT32 cap = tl->sampleCap > 0 ? tl->sampleCap * 2 : 1024;
+    while (cap <= id) {
+        cap *= 2;
+    }
+    UINT32* left = new UINT32[cap];
+    std::copy(tl->sampleLeft, tl->sampleLeft + tl->sampleCap, left);
+    std::fill(left + tl->sampleCap, left + cap, sampling.period);
+    delete[] tl->sampleLeft;
+    tl->sampleLeft = left;
+    tl->sampleCap = cap;
+}
+
+// inserted as the if-call before sampled blocks, counts down the thread's executions
+// of the block and decides whether they are recorded, true when the period is over
+ADDRINT SampleTick(ThreadLog* tl, UINT32 id) {
+    UINT32 left = --tl->sampleLeft[id];
+    tl->sampled = left == 0;
+    return left == 0;
+}
+
+VOID SampleReset(ThreadLog* tl, UINT32 id) {
+    tl->sampleLeft[id] = sampling.period;
+}
+
+// inserted as the if-call before blocks in burst mode, true when the burst or gap is over
+ADDRINT BurstTick(ThreadLog* tl, UINT32 numIns) {
+    tl->executed += numIns;
+    tl->burstLeft -= numIns;
+    return tl->burstLeft <= 0;
+}
+
+// append a record outside of any block reservation. Inside a block it takes one
+// of the EVENT_HEADROOM entries, so the flush only happens between blocks.
+VOID AppendEvent(ThreadLog* tl, ADDRINT ip, UINT32 rw, ADDRINT addr, UINT32 size) {
+    if (tl->count + 1 > BUFFER_ENTRIES) {
+        FlushThreadLog(tl);
+    }
+    AppendAccess(tl, ip, rw, addr, size);
+}
+
+VOID AppendBurstMark(ThreadLog* tl, ADDRINT ip) {
+    AppendEvent(tl, ip, TRACE_BURST, tl->executed, tl->sampled);
+}
+
+// switch between tracing and skipping at a block head
+VOID BurstToggle(ThreadLog* tl, ADDRINT ip) {
+    tl->sampled = !tl->sampled;
+    tl->burstLeft += tl->sampled ? sampling.burstOn : sampling.burstOff;
+    AppendBurstMark(tl, ip);
+}
+
+// insert the sampling decision at the head of a block
+VOID InsertSampling(INS head, BlockLog* block) {
+    if (sampling.period > 1) {
+        INS_InsertIfCall(
+            head, IPOINT_BEFORE,
+            (AFUNPTR)SampleCountsFull,
+            IARG_REG_VALUE, scratchReg,
+            IARG_UINT32, block->id,
+            IARG_END
+        );
+        INS_InsertThenCall(
+            head, IPOINT_BEFORE,
+            (AFUNPTR)GrowSampleCounts,
+            IARG_REG_VALUE, scratchReg,
+            IARG_UINT32, block->id,
+            IARG_END
+        );
+        INS_InsertIfCall(
+            head, IPOINT_BEFORE,
+            (AFUNPTR)SampleTick,
+            IARG_REG_VALUE, scratchReg,
+            IARG_UINT32, block->id,
+            IARG_END
+        );
+        INS_InsertThenCall(
+            head, IPOINT_BEFORE,
+            (AFUNPTR)SampleReset,
+            IARG_REG_VALUE, scratchReg,
+            IARG_UINT32, block->id,
+            IARG_END
+        );
+    } else if (sampling.burstOn > 0) {
+        INS_InsertIfCall(
+            head, IPOINT_BEFORE,
+            (AFUNPTR)BurstTick,
+            IARG_REG_VALUE, scratchReg,
+            IARG_UINT32, (UINT32)block->ips.size(),
+            IARG_END
+        );
+        INS_InsertThenCall(
+            head, IPOINT_BEFORE,
+            (AFUNPTR)BurstToggle,
+            IARG_REG_VALUE, scratchReg,
+            IARG_INST_PTR,
+            IARG_END
+        );
+    }
+}
+
+typedef VOID (*InsertCallFunc)(INS, IPOINT, AFUNPTR, ...);
+
+// return the function inserting a record call at ipoint, which is only a then-call
+// behind IsSampled when sampling, so skipped executions cost an inlined check
+InsertCallFunc InsertRecordCall(INS ins, IPOINT ipoint) {
+    if (!Sampling()) {
+        return INS_InsertCall;
+    }
+    INS_InsertIfCall(
+        ins, ipoint,
+        (AFUNPTR)IsSampled,
+        IARG_REG_VALUE, scratchReg,
+        IARG_END
+    );
+    return INS_InsertThenCall;
+}
+
+/* ===================================================================== */
+// Heap tracking
+/* ===================================================================== */
+
+// allocator entry points, with how their arguments give the size
+enum AllocKind {
+    ALLOC_MALLOC,       // size
+    ALLOC_CALLOC,       // count, size
+    ALLOC_REALLOC,      // old pointer, size
+    ALLOC_FREE          // pointer
+};
+
+struct AllocFunc {
+    const char* name;
+    AllocKind kind;
+};
+
+#if defined(TARGET_MAC)
+#define SYMBOL_PREFIX "_"
+#else
+#define SYMBOL_PREFIX ""
+#endif
+
+// operator new and delete are hooked too, so sites are in the program rather than in libc++
+const AllocFunc allocFuncs[] = {
+    { SYMBOL_PREFIX "malloc", ALLOC_MALLOC },
+    { SYMBOL_PREFIX "calloc", ALLOC_CALLOC },
+    { SYMBOL_PREFIX "realloc", ALLOC_REALLOC },
+    { SYMBOL_PREFIX "free", ALLOC_FREE },
+    { SYMBOL_PREFIX "_Znwm", ALLOC_MALLOC },
+    { SYMBOL_PREFIX "_Znam", ALLOC_MALLOC },
+    { SYMBOL_PREFIX "_ZdlPv", ALLOC_FREE },
+    { SYMBOL_PREFIX "_ZdaPv", ALLOC_FREE }
+};
+
+// inserted at the entry of allocators, remembers the request until they return.
+// Nesting goes by the stack pointer rather than a depth, as allocators tail-call
+// each other: realloc(NULL, n) jumps to malloc, which then returns for both.
+VOID AllocEnter(ThreadLog* tl, ADDRINT kind, ADDRINT arg0, ADDRINT arg1, ADDRINT site, ADDRINT sp) {
+    // a call below the request's frame is nested, one in the same frame is a tail call
+    // which the request covers. A request above the stack pointer was left by a
+    // longjmp or a missed return and is dropped.
+    if (tl->allocSp != 0 && sp <= tl->allocSp) {
+        return;
+    }
+    tl->allocSp = sp;
+    tl->allocKind = kind;
+    tl->allocSite = site;
+    tl->allocOld = kind == ALLOC_REALLOC ? arg0 : 0;
+    tl->allocSize = kind == ALLOC_CALLOC ? arg0 * arg1 : kind == ALLOC_REALLOC ? arg1 : arg0;
+}
+
+// inserted at the returns of allocators, the request ends at the return from its frame
+VOID AllocLeave(ThreadLog* tl, ADDRINT ret, ADDRINT sp) {
+    if (tl->allocSp == 0 || sp < tl->allocSp) {
+        return;
+    }
+    tl->allocSp = 0;
+
+    // a failed realloc keeps the old block, except realloc(p, 0) which frees it
+    if (tl->allocOld != 0 && (ret != 0 || tl->allocSize == 0)) {
+        AppendEvent(tl, tl->allocSite, TRACE_FREE, tl->allocOld, 0);
+    }
+    if (ret != 0) {
+        UINT32 size = tl->allocSize > 0xffffffff ? 0xffffffff : tl->allocSize;
+        AppendEvent(tl, tl->allocSite, TRACE_ALLOC, ret, size);
+    }
+}
+
+// inserted at the entry of free and operator delete
+VOID FreeEnter(ThreadLog* tl, ADDRINT ptr, ADDRINT site, ADDRINT sp) {
+    if ((tl->allocSp == 0 || sp > tl->allocSp) && ptr != 0) {
+        AppendEvent(tl, site, TRACE_FREE, ptr, 0);
+    }
+}
+
+// hook the allocators of a newly loaded image. The calls go first at their
+// instruction, so their records come before those of a traced allocator's code.
+VOID InstrumentAllocators(IMG img) {
+    for (size_t i = 0; i < sizeof(allocFuncs) / sizeof(allocFuncs[0]); i++) {
+        RTN rtn = RTN_FindByName(img, allocFuncs[i].name);
+        if (!RTN_Valid(rtn)) {
+            continue;
+        }
+
+        RTN_Open(rtn);
+        if (allocFuncs[i].kind == ALLOC_FREE) {
+            RTN_InsertCall(
+                rtn, IPOINT_BEFORE,
+                (AFUNPTR)FreeEnter,
+                IARG_CALL_ORDER, CALL_ORDER_FIRST,
+                IARG_REG_VALUE, scratchReg,
+                IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+                IARG_RETURN_IP,
+                IARG_REG_VALUE, REG_STACK_PTR,
+                IARG_END
+            );
+        } else {
+            RTN_InsertCall(
+                rtn, IPOINT_BEFORE,
+                (AFUNPTR)AllocEnter,
+                IARG_CALL_ORDER, CALL_ORDER_FIRST,
+                IARG_REG_VALUE, scratchReg,
+                IARG_ADDRINT, (ADDRINT)allocFuncs[i].kind,
+                IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+                IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
+                IARG_RETURN_IP,
+                IARG_REG_VALUE, REG_STACK_PTR,
+                IARG_END
+            );
+            RTN_InsertCall(
+                rtn, IPOINT_AFTER,
+                (AFUNPTR)AllocLeave,
+                IARG_CALL_ORDER, CALL_ORDER_FIRST,
+                IARG_REG_VALUE, scratchReg,
+                IARG_FUNCRET_EXITPOINT_VALUE,
+                IARG_REG_VALUE, REG_STACK_PTR,
+                IARG_END
+            );
+        }
+        RTN_Close(rtn);
+    }
+}
+
+/* ===================================================================== */
+// Taint tracking
+/* ===================================================================== */
+
+// tainted application memory with -taint, shared by all threads without a lock
+TaintMemory taintMemory;
+
+// bytes tainted by input syscalls, and by -taint_mark and -taint_range
+volatile UINT64 taintedByInput = 0;
+volatile UINT64 taintedByMarks = 0;
+
+// file descriptors from -taint_fd, any if empty
+vector<ADDRINT> taintFds;
+
+// a register operand, as the bytes of its full register it covers
+struct TaintReg {
+    REG full;
+    UINT32 shift;       // first byte covered
+    UINT64 width;       // mask of the bytes covered, shifted down to bit 0
+    UINT64 cleared;     // bytes of the full register a write replaces
+};
+
+// how taint flows through an instruction, built when it is first instrumented
+struct TaintIns {
+    vector<TaintReg> reads;
+    vector<TaintReg> writes;
+    BOOL readsMem;
+    BOOL writesMem;
+    BOOL copy;          // moves its only source unchanged into its only destination
+    BOOL clears;        // xor r, r and alike, the destination ends up untainted
+    BOOL reported;      // in traced code, so its executions reading tainted data are counted
+    volatile UINT64 consumed;   // executions which read tainted data
+};
+
+// keyed by instruction address, protected by logLock
+AddrTable<TaintIns*> taintInsLogs;
+
+TaintReg MakeTaintReg(REG reg) {
+    TaintReg taintReg;
+    taintReg.full = REG_FullRegName(reg);
+    taintReg.shift = REG_is_Upper8(reg) ? 1 : 0;
+    UINT32 size = REG_Size(reg);
+    taintReg.width = size >= 64 ? ~(UINT64)0 : ((UINT64)1 << size) - 1;
+    // writing a 32-bit register zeroes the upper half of the 64-bit one
+    taintReg.cleared = REG_is_gr32(reg) ? (UINT64)0xff : taintReg.width << taintReg.shift;
+    return taintReg;
+}
+
+// whether the instruction zeroes its destination whatever the value, as xor eax, eax does
+BOOL ClearsDestination(INS ins) {
+    static const char* idioms[] = { "XOR", "SUB", "PXOR", "XORPS", "XORPD", "VPXOR", "VXORPS", "VXORPD" };
+    string mnemonic = INS_Mnemonic(ins);
+    // VEX forms take the destination first and then the two sources
+    UINT32 first = mnemonic[0] == 'V' ? 1 : 0;
+
+    for (size_t i = 0; i < sizeof(idioms) / sizeof(idioms[0]); i++) {
+        if (mnemonic == idioms[i]) {
+            return INS_OperandCount(ins) > first + 1 &&
+                INS_OperandIsReg(ins, first) && INS_OperandIsReg(ins, first + 1) &&
+                INS_OperandReg(ins, first) == INS_OperandReg(ins, first + 1);
+        }
+    }
+    return FALSE;
+}
+
+// whether reg is an operand of its own, not only part of an address
+BOOL IsRegOperand(INS ins, REG reg) {
+    for (UINT32 i = 0; i < INS_OperandCount(ins); i++) {
+        if (INS_OperandIsReg(ins, i) && INS_OperandReg(ins, i) == reg) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// find or build the taint flow of an instruction, caller holds logLock
+TaintIns* GetTaintIns(INS ins) {
+    TaintIns*& ti = taintInsLogs[INS_Address(ins)];
+    if (ti) {
+        return ti;
+    }
+    ti = new TaintIns;
+
+    // registers used only to form an address carry no data into the result
+    vector<REG> addressRegs;
+    if (!INS_IsLea(ins)) {
+        addressRegs.push_back(INS_MemoryBaseReg(ins));
+        addressRegs.push_back(INS_MemoryIndexReg(ins));
+    }
+
+    for (UINT32 i = 0; i < INS_MaxNumRRegs(ins); i++) {
+        REG reg = INS_RegR(ins, i);
+        BOOL addressOnly = std::find(addressRegs.begin(), addressRegs.end(), reg) != addressRegs.end() &&
+            !IsRegOperand(ins, reg);
+        if (!addressOnly && REG_FullRegName(reg) != REG_STACK_PTR && REG_FullRegName(reg) != REG_INST_PTR) {
+            ti->reads.push_back(MakeTaintReg(reg));
+        }
+    }
+    for (UINT32 i = 0; i < INS_MaxNumWRegs(ins); i++) {
+        REG reg = INS_RegW(ins, i);
+        if (REG_FullRegName(reg) != REG_STACK_PTR && REG_FullRegName(reg) != REG_INST_PTR) {
+            ti->writes.push_back(MakeTaintReg(reg));
+        }
+    }
+
+    ti->readsMem = FALSE;
+    ti->writesMem = FALSE;
+    for (UINT32 memOp = 0; memOp < INS_MemoryOperandCount(ins); memOp++) {
+        ti->readsMem |= INS_MemoryOperandIsRead(ins, memOp);
+        ti->writesMem |= INS_MemoryOperandIsWritten(ins, memOp);
+    }
+
+    UINT32 category = INS_Category(ins);
+    UINT32 sources = ti->reads.size() + (ti->readsMem ? 1 : 0);
+    UINT32 destinations = ti->writes.size() + (ti->writesMem ? 1 : 0);
+    ti->copy = (category == XED_CATEGORY_DATAXFER || category == XED_CATEGORY_PUSH || category == XED_CATEGORY_POP) &&
+        sources == 1 && destinations == 1;
+    ti->clears = ClearsDestination(ins);
+    ti->reported = FALSE;
+    ti->consumed = 0;
+    return ti;
+}
+
+// inserted as the if-call before instructions without memory operands, true if
+// any register of the thread is tainted
+ADDRINT RegTaintLive(ThreadLog* tl) {
+    return tl->taintedRegs;
+}
+
+// inserted as the if-call before instructions accessing memory, true if any register
+// of the thread or the page at either end of the access holds taint
+ADDRINT MemTaintLive(ThreadLog* tl, ADDRINT ea, UINT32 size) {
+    return tl->taintedRegs | taintMemory.pageTaint(ea) | taintMemory.pageTaint(ea + size - 1);
+}
+
+// the same for instructions both reading and writing memory
+ADDRINT MemTaintLive2(ThreadLog* tl, ADDRINT readEa, UINT32 readSize, ADDRINT writeEa, UINT32 writeSize) {
+    return tl->taintedRegs | taintMemory.pageTaint(readEa) | taintMemory.pageTaint(readEa + readSize - 1) |
+        taintMemory.pageTaint(writeEa) | taintMemory.pageTaint(writeEa + writeSize - 1);
+}
+
+UINT64 ReadRegTaint(ThreadLog* tl, const TaintReg& reg) {
+    return (tl->regTaint[reg.full] >> reg.shift) & reg.width;
+}
+
+VOID WriteRegTaint(ThreadLog* tl, const TaintReg& reg, UINT64 bytes) {
+    UINT64& taint = tl->regTaint[reg.full];
+    BOOL wasTainted = taint != 0;
+    taint = (taint & ~reg.cleared) | ((bytes & reg.width) << reg.shift);
+    if (taint != 0 && !wasTainted) {
+        tl->taintedRegs++;
+    } else if (taint == 0 && wasTainted) {
+        tl->taintedRegs--;
+    }
+}
+
+// move the taint of the sources to the destinations; a copy moves it byte by byte,
+// anything else taints every destination byte if any source byte is tainted.
+// Register taint belongs to the thread and memory taint needs no lock, so
+// threads propagate side by side.
+inline VOID PropagateTaint(ThreadLog* tl, TaintIns* ti, ADDRINT readEa, UINT32 readSize, ADDRINT writeEa, UINT32 writeSize) {
+    BOOL consumed = FALSE;
+    if (ti->copy && readSize <= 64 && writeSize <= 64) {
+        UINT64 bytes = ti->readsMem ? taintMemory.mask(readEa, readSize) : ReadRegTaint(tl, ti->reads[0]);
+        if (ti->writesMem) {
+            taintMemory.assign(writeEa, writeSize, bytes);
+        } else {
+            WriteRegTaint(tl, ti->writes[0], bytes);
+        }
+        consumed = bytes != 0;
+    } else {
+        if (!ti->clears) {
+            for (size_t i = 0; i < ti->reads.size() && !consumed; i++) {
+                consumed = ReadRegTaint(tl, ti->reads[i]) != 0;
+            }
+            if (ti->readsMem && !consumed) {
+                consumed = taintMemory.any(readEa, readSize);
+            }
+        }
+        for (size_t i = 0; i < ti->writes.size(); i++) {
+            WriteRegTaint(tl, ti->writes[i], consumed ? ~(UINT64)0 : 0);
+        }
+        if (ti->writesMem) {
+            taintMemory.fill(writeEa, writeSize, consumed);
+        }
+    }
+
+    if (consumed && ti->reported) {
+        __sync_fetch_and_add(&ti->consumed, 1);
+    }
+}
+
+// inserted as the then-call of each flow class, so each gets its own copy of the propagation
+VOID PropagateRegTaint(ThreadLog* tl, TaintIns* ti) {
+    PropagateTaint(tl, ti, 0, 0, 0, 0);
+}
+
+VOID PropagateLoadTaint(ThreadLog* tl, TaintIns* ti, ADDRINT readEa, UINT32 readSize) {
+    PropagateTaint(tl, ti, readEa, readSize, 0, 0);
+}
+
+VOID PropagateStoreTaint(ThreadLog* tl, TaintIns* ti, ADDRINT writeEa, UINT32 writeSize) {
+    PropagateTaint(tl, ti, 0, 0, writeEa, writeSize);
+}
+
+VOID PropagateMemTaint(ThreadLog* tl, TaintIns* ti, ADDRINT readEa, UINT32 readSize, ADDRINT writeEa, UINT32 writeSize) {
+    PropagateTaint(tl, ti, readEa, readSize, writeEa, writeSize);
+}
+
+// insert the taint propagation of an instruction, which only runs once its registers or pages hold taint
+VOID InstrumentTaint(INS ins, BOOL traced) {
+    PIN_GetLock(&logLock, PIN_ThreadId() + 1);
+    TaintIns* ti = GetTaintIns(ins);
+    ti->reported |= traced;
+    PIN_ReleaseLock(&logLock);
+
+    if (ti->reads.empty() && ti->writes.empty() && !ti->readsMem && !ti->writesMem) {
+        return;
+    }
+
+    // the first memory operand read and the first written, if any
+    INT32 readOp = -1;
+    INT32 writeOp = -1;
+    for (UINT32 memOp = 0; memOp < INS_MemoryOperandCount(ins); memOp++) {
+        if (readOp < 0 && INS_MemoryOperandIsRead(ins, memOp)) {
+            readOp = memOp;
+        }
+        if (writeOp < 0 && INS_MemoryOperandIsWritten(ins, memOp)) {
+            writeOp = memOp;
+        }
+    }
+
+    if (readOp >= 0 && writeOp >= 0) {
+        INS_InsertIfCall(
+            ins, IPOINT_BEFORE,
+            (AFUNPTR)MemTaintLive2,
+            IARG_REG_VALUE, scratchReg,
+            IARG_MEMORYOP_EA, readOp,
+            IARG_MEMORYREAD_SIZE,
+            IARG_MEMORYOP_EA, writeOp,
+            IARG_MEMORYWRITE_SIZE,
+            IARG_END
+        );
+        INS_InsertThenCall(
+            ins, IPOINT_BEFORE,
+            (AFUNPTR)PropagateMemTaint,
+            IARG_REG_VALUE, scratchReg,
+            IARG_PTR, ti,
+            IARG_MEMORYOP_EA, readOp,
+            IARG_MEMORYREAD_SIZE,
+            IARG_MEMORYOP_EA, writeOp,
+            IARG_MEMORYWRITE_SIZE,
+            IARG_END
+        );
+    } else if (readOp >= 0) {
+        INS_InsertIfCall(
+            ins, IPOINT_BEFORE,
+            (AFUNPTR)MemTaintLive,
+            IARG_REG_VALUE, scratchReg,
+            IARG_MEMORYOP_EA, readOp,
+            IARG_MEMORYREAD_SIZE,
+            IARG_END
+        );
+        INS_InsertThenCall(
+            ins, IPOINT_BEFORE,
+            (AFUNPTR)PropagateLoadTaint,
+            IARG_REG_VALUE, scratchReg,
+            IARG_PTR, ti,
+            IARG_MEMORYOP_EA, readOp,
+            IARG_MEMORYREAD_SIZE,
+            IARG_END
+        );
+    } else if (writeOp >= 0) {
+        INS_InsertIfCall(
+            ins, IPOINT_BEFORE,
+            (AFUNPTR)MemTaintLive,
+            IARG_REG_VALUE, scratchReg,
+            IARG_MEMORYOP_EA, writeOp,
+            IARG_MEMORYWRITE_SIZE,
+            IARG_END
+        );
+        INS_InsertThenCall(
+            ins, IPOINT_BEFORE,
+            (AFUNPTR)PropagateStoreTaint,
+            IARG_REG_VALUE, scratchReg,
+            IARG_PTR, ti,
+            IARG_MEMORYOP_EA, writeOp,
+            IARG_MEMORYWRITE_SIZE,
+            IARG_END
+        );
+    } else {
+        INS_InsertIfCall(
+            ins, IPOINT_BEFORE,
+            (AFUNPTR)RegTaintLive,
+            IARG_REG_VALUE, scratchReg,
+            IARG_END
+        );
+        INS_InsertThenCall(
+            ins, IPOINT_BEFORE,
+            (AFUNPTR)PropagateRegTaint,
+            IARG_REG_VALUE, scratchReg,
+            IARG_PTR, ti,
+            IARG_END
+        );
+    }
+}
+
+// taint `size` bytes at `addr` as a source
+VOID TaintSource(THREADID tid, ADDRINT addr, ADDRINT size, volatile UINT64& total) {
+    taintMemory.set(addr, size);
+    __sync_fetch_and_add(&total, size);
+}
+
+#if defined(SYS_pread64)
+#define SYS_PREAD SYS_pread64
+#else
+#define SYS_PREAD SYS_pread
+#endif
+
+// syscalls filling the buffer in their second argument with the bytes they return
+BOOL IsInputSyscall(ADDRINT num) {
+    return num == SYS_read || num == SYS_PREAD || num == SYS_recvfrom;
+}
+
+VOID TaintSyscallEntry(THREADID tid, CONTEXT *ctxt, SYSCALL_STANDARD std, VOID *v) {
+    ThreadLog* tl = static_cast<ThreadLog*>(PIN_GetThreadData(tlsKey, tid));
+    tl->taintInput = IsInputSyscall(PIN_GetSyscallNumber(ctxt, std));
+    tl->taintFd = PIN_GetSyscallArgument(ctxt, std, 0);
+    tl->taintBuf = PIN_GetSyscallArgument(ctxt, std, 1);
+}
+
+VOID TaintSyscallExit(THREADID tid, CONTEXT *ctxt, SYSCALL_STANDARD std, VOID *v) {
+    ThreadLog* tl = static_cast<ThreadLog*>(PIN_GetThreadData(tlsKey, tid));
+    if (!tl->taintInput) {
+        return;
+    }
+    tl->taintInput = FALSE;
+
+    INT64 bytes = (INT64)PIN_GetSyscallReturn(ctxt, std);
+    if (bytes > 0 && (taintFds.empty() ||
+            std::find(taintFds.begin(), taintFds.end(), tl->taintFd) != taintFds.end())) {
+        TaintSource(tid, tl->taintBuf, bytes, taintedByInput);
+    }
+}
+
+// inserted at the entry of the functions named by -taint_mark
+VOID TaintMark(THREADID tid, ADDRINT buf, ADDRINT size) {
+    TaintSource(tid, buf, size, taintedByMarks);
+}
+
+// hook the -taint_mark functions of a newly loaded image
+VOID InstrumentTaintMarks(IMG img) {
+    vector<string> marks = AppendedValues(KnobTaintMark);
+    for (size_t i = 0; i < marks.size(); i++) {
+        RTN rtn = RTN_FindByName(img, (SYMBOL_PREFIX + marks[i]).c_str());
+        if (!RTN_Valid(rtn)) {
+            continue;
+        }
+
+        RTN_Open(rtn);
+        RTN_InsertCall(
+            rtn, IPOINT_BEFORE,
+            (AFUNPTR)TaintMark,
+            IARG_THREAD_ID,
+            IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+            IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
+            IARG_END
+        );
+        RTN_Close(rtn);
+    }
+}
+
+/* ===================================================================== */
+// Block counting
+/* ===================================================================== */
+
+// inserted as the if-call before every block, true if the thread has no counter for it yet
+ADDRINT BlockCountsFull(ThreadLog* tl, UINT32 id) {
+    return id >= tl->blockCap;
+}
+
+VOID GrowBlockCounts(ThreadLog* tl, UINT32 id) {
+    UINT32 cap = tl->blockCap > 0 ? tl->blockCap * 2 : 1024;
+    while (cap <= id) {
+        cap *= 2;
+    }
+    UINT64* counts = new UINT64[cap]();
+    std::copy(tl->blockCounts, tl->blockCounts + tl->blockCap, counts);
+    delete[] tl->blockCounts;
+    tl->blockCounts = counts;
+    tl->blockCap = cap;
+}
+
+// inserted before every block, so instructions are counted once per block
+VOID CountBlock(ThreadLog* tl, UINT32 id) {
+    tl->blockCounts[id]++;
+}
+
+VOID InsertCounting(INS head, BlockLog* block) {
+    INS_InsertIfCall(
+        head, IPOINT_BEFORE,
+        (AFUNPTR)BlockCountsFull,
+        IARG_REG_VALUE, scratchReg,
+        IARG_UINT32, block->id,
+        IARG_END
+    );
+    INS_InsertThenCall(
+        head, IPOINT_BEFORE,
+        (AFUNPTR)GrowBlockCounts,
+        IARG_REG_VALUE, scratchReg,
+        IARG_UINT32, block->id,
+        IARG_END
+    );
+    INS_InsertCall(
+        head, IPOINT_BEFORE,
+        (AFUNPTR)CountBlock,
+        IARG_REG_VALUE, scratchReg,
+        IARG_UINT32, block->id,
+        IARG_END
+    );
+}
+
+// threads add their instructions in batches, so the shared count is rarely touched
+const UINT64 DETACH_BATCH = 1 << 16;
+
+volatile UINT64 detachCount = 0;
+volatile BOOL detachRequested = FALSE;
+
+// inserted as the if-call before every block with -detach_ins
+ADDRINT DetachBatchFull(ThreadLog* tl, UINT32 numIns) {
+    tl->detachBatch += numIns;
+    return tl->detachBatch >= DETACH_BATCH;
+}
+
+VOID CountTowardsDetach(ThreadLog* tl) {
+    UINT64 total = __sync_add_and_fetch(&detachCount, tl->detachBatch);
+    tl->detachBatch = 0;
+    if (total >= KnobDetachIns && __sync_bool_compare_and_swap(&detachRequested, FALSE, TRUE)) {
+        PIN_Detach();
+    }
+}
+
+VOID InsertDetachCheck(INS head, BlockLog* block) {
+    INS_InsertIfCall(
+        head, IPOINT_BEFORE,
+        (AFUNPTR)DetachBatchFull,
+        IARG_REG_VALUE, scratchReg,
+        IARG_UINT32, (UINT32)block->ips.size(),
+        IARG_END
+    );
+    INS_InsertThenCall(
+        head, IPOINT_BEFORE,
+        (AFUNPTR)CountTowardsDetach,
+        IARG_REG_VALUE, scratchReg,
+        IARG_END
+    );
+}
+
+// add the counters of an exiting thread to blockCounts, caller holds logLock.
+// The thread's counters are rounded up past the last block, blockCounts is not.
+VOID MergeBlockCounts(ThreadLog* tl) {
+    if (blockCounts.size() < blockList.size()) {
+        blockCounts.resize(blockList.size());
+    }
+    UINT32 merged = tl->blockCap < blockCounts.size() ? tl->blockCap : blockCounts.size();
+    for (UINT32 i = 0; i < merged; i++) {
+        blockCounts[i] += tl->blockCounts[i];
+    }
+}
+
+// inserted for blocks which do not access memory, records all their instructions at once
+VOID RecordBlock(ThreadLog* tl, BlockLog* block) {
+    UINT32 numIns = block->ips.size();
+    UINT64 seq = __sync_fetch_and_add(&order, numIns);
+
+    for (UINT32 i = 0; i < numIns; i++) {
+        TraceRecord& rec = tl->entries[tl->count++];
+        rec.seq = seq + i;
+        rec.ip = block->ips[i];
+        rec.ea = 0;
+        rec.size = 0;
+        rec.rw = TRACE_NO_MEM;
+    }
+}
+
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v) {
+    ThreadLog* tl = new ThreadLog;
+    tl->current = 0;
+    tl->entries = tl->buffers[0];
+    tl->count = 0;
+    tl->tid = tid;
+    tl->pendingSize = 0;
+    tl->frames = KnobLayout.Value().empty() ? 0 : new FrameTracker;
+    for (UINT32 i = 0; i < 2; i++) {
+        PIN_SemaphoreInit(&tl->bufferFree[i]);
+        PIN_SemaphoreSet(&tl->bufferFree[i]);
+    }
+
+    // -sample decides per block, bursts start with tracing on
+    tl->sampled = sampling.period <= 1;
+    tl->burstLeft = sampling.burstOn;
+    tl->executed = 0;
+    tl->blockCounts = 0;
+    tl->blockCap = 0;
+    tl->sampleLeft = 0;
+    tl->sampleCap = 0;
+    tl->allocSp = 0;
+    tl->detachBatch = 0;
+    tl->regTaint = KnobTaint.Value().empty() ? 0 : new UINT64[REG_LAST]();
+    tl->taintedRegs = 0;
+    tl->taintInput = FALSE;
+    __sync_fetch_and_add(&threadCount, 1);
+
+    if (sampling.burstOn > 0) {
+        AppendBurstMark(tl, 0);
+    }
+
+    PIN_GetLock(&logLock, tid + 1);
+    threadLogs.push_back(tl);
+    PIN_ReleaseLock(&logLock);
+
+    PIN_SetThreadData(tlsKey, tl, tid);
+    PIN_SetContextReg(ctxt, scratchReg, (ADDRINT)tl);
+}
+
+// flush a thread's records and merge its counters and layouts, then free its ThreadLog
+VOID FinishThreadLog(ThreadLog* tl) {
+    FlushThreadLog(tl);
+
+    // wait until the writer is done with both buffers
+    for (UINT32 i = 0; i < 2; i++) {
+        PIN_SemaphoreWait(&tl->bufferFree[i]);
+        PIN_SemaphoreFini(&tl->bufferFree[i]);
+    }
+
+    PIN_GetLock(&logLock, tl->tid + 1);
+    MergeBlockCounts(tl);
+    if (tl->frames) {
+        tl->frames->mergeInto(frameLayouts);
+    }
+    threadLogs.erase(std::find(threadLogs.begin(), threadLogs.end(), tl));
+    PIN_ReleaseLock(&logLock);
+
+    delete tl->frames;
+    delete[] tl->blockCounts;
+    delete[] tl->sampleLeft;
+    delete[] tl->regTaint;
+    delete tl;
+}
+
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v) {
+    ThreadLog* tl = static_cast<ThreadLog*>(PIN_GetThreadData(tlsKey, tid));
+    PIN_SetThreadData(tlsKey, 0, tid);
+    FinishThreadLog(tl);
+}
+
+
+// decode the static log of an instruction the first time it is seen, caller holds logLock
+const InsLog& DecodeIns(INS ins) {
+    //https://software.intel.com/sites/landingpage/pintool/docs/97619/Pin/html/group__INS__BASIC__API__GEN__IA32.html
+    ADDRINT addr = INS_Address(ins);
+
+    // instructions get instrumented again when their trace is re-jitted, reuse the first log
+    InsLog* decoded = insLogs.find(addr);
+    if (decoded) {
+        return *decoded;
+    }
+
+    InsLog& insLog = insLogs[addr];
+    insLog.mnemonic = INS_Mnemonic(ins);
+    insLog.readsFloat = FALSE;
+    insLog.writesFloat = FALSE;
+
+    std::ostringstream detailStream;
+    detailStream << std::hex << addr << " " << insLog.mnemonic;
+
+    UINT32 memRRegs = INS_MaxNumRRegs(ins);
+    UINT32 memWRegs = INS_MaxNumWRegs(ins);
+
+    if (memRRegs > 0) {
+        detailStream << " -r->";
+        for( UINT32 i=0; i < memRRegs; i++ ) {
+            REG reg = INS_RegR(ins, i);
+            insLog.readRegs.push_back(reg);
+            detailStream << " " << REG_StringShort(reg);
+            if ( REG_is_fr( reg ) ) {
+                insLog.readsFloat = TRUE;
+                detailStream << " (float)";
+            }
+        }
+    }
+    if (memWRegs > 0) {
+        detailStream << " -w->";
+        for( UINT32 i=0; i < memWRegs; i++ ) {
+            REG reg = INS_RegW(ins, i);
+            insLog.writeRegs.push_back(reg);
+            detailStream << " " << REG_StringShort(reg);
+            if ( REG_is_fr( reg ) ) {
+                insLog.writesFloat = TRUE;
+                detailStream << " (float)";
+            }
+        }
+    }
+
+    detailStream << endl;
+    insLog.text = detailStream.str();
+
+    insLog.flags = 0;
+    if (INS_IsCall(ins)) {
+        insLog.flags |= TRACE_INS_CALL;
+    } else if (INS_IsRet(ins)) {
+        insLog.flags |= TRACE_INS_RET;
+    } else if (INS_IsBranch(ins)) {
+        insLog.flags |= TRACE_INS_BRANCH;
+    }
+
+    if (KnobStream) {
+        newIns.push_back(addr);
+    }
+
+    return insLog;
+}
+
+// whether the values read and written by the instruction are captured
+BOOL CapturesValues(INS ins) {
+    if (!KnobValues) {
+        return FALSE;
+    }
+    if (valueClasses.empty()) {
+        return TRUE;
+    }
+    return std::find(valueClasses.begin(), valueClasses.end(), CATEGORY_StringShort(INS_Category(ins))) != valueClasses.end();
+}
+
+// where values written by the instruction can be read, or FALSE if nowhere
+BOOL ValuePoint(INS ins, IPOINT& ipoint) {
+    if (INS_IsValidForIpointAfter(ins)) {
+        ipoint = IPOINT_AFTER;
+    } else if (INS_IsValidForIpointTakenBranch(ins)) {
+        ipoint = IPOINT_TAKEN_BRANCH;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// positions of the written general purpose registers whose values are captured
+vector<UINT32> CapturedRegs(INS ins) {
+    vector<UINT32> captured;
+    IPOINT ipoint;
+    if (!CapturesValues(ins) || !KnobValueRegs || !ValuePoint(ins, ipoint)) {
+        return captured;
+    }
+
+    UINT32 memWRegs = INS_MaxNumWRegs(ins);
+    for (UINT32 i = 0; i < memWRegs; i++) {
+        REG reg = INS_RegW(ins, i);
+        if (REG_is_gr(REG_FullRegName(reg))) {
+            captured.push_back(i);
+        }
+    }
+    return captured;
+}
+
+// number of records one execution of the instruction appends
+UINT32 RecordsPerExecution(INS ins) {
+    UINT32 memOperands = INS_MemoryOperandCount(ins);
+    UINT32 records = 0;
+
+    if (memOperands == 0) {
+        records = 1;
+    }
+    for (UINT32 memOp = 0; memOp < memOperands; memOp++) {
+        if (INS_MemoryOperandIsRead(ins, memOp) || INS_MemoryOperandIsWritten(ins, memOp)) {
+            // plus the captured value
+            records += CapturesValues(ins) ? 2 : 1;
+        }
+    }
+    return records + CapturedRegs(ins).size();
+}
+
+// flush the thread buffer before `ins` unless the next `records` records fit
+VOID InsertReserve(INS ins, UINT32 records) {
+    INS_InsertIfCall(
+        ins, IPOINT_BEFORE,
+        (AFUNPTR)BufferFull,
+        IARG_REG_VALUE, scratchReg,
+        IARG_UINT32, records,
+        IARG_END
+    );
+    INS_InsertThenCall(
+        ins, IPOINT_BEFORE,
+        (AFUNPTR)FlushThreadLog,
+        IARG_REG_VALUE, scratchReg,
+        IARG_END
+    );
+}
+
+VOID InstrumentIns(INS ins) {
+    UINT32 memOperands = INS_MemoryOperandCount(ins);
+    BOOL capture = CapturesValues(ins);
+    BOOL captureWrite = FALSE;
+
+    if (memOperands > 0) {
+        // Iterate over each memory operand of the instruction.
+        for (UINT32 memOp = 0; memOp < memOperands; memOp++) {
+            if (INS_MemoryOperandIsRead(ins, memOp)) {
+                InsertRecordCall(ins, IPOINT_BEFORE)(
+                    ins, IPOINT_BEFORE,
+                    (AFUNPTR)(capture ? RecordMemReadValue : RecordMemRead),
+                    IARG_REG_VALUE, scratchReg,
+                    IARG_INST_PTR,
+                    IARG_MEMORYOP_EA, memOp,
+                    IARG_MEMORYREAD_SIZE,
+                    IARG_END
+                );
+            } else if (INS_MemoryOperandIsWritten(ins, memOp)) {
+                InsertRecordCall(ins, IPOINT_BEFORE)(
+                    ins, IPOINT_BEFORE,
+                    (AFUNPTR)(capture ? RecordMemWriteValue : RecordMemWrite),
+                    IARG_REG_VALUE, scratchReg,
+                    IARG_INST_PTR,
+                    IARG_MEMORYOP_EA, memOp,
+                    IARG_MEMORYWRITE_SIZE,
+                    IARG_END
+                );
+                captureWrite = capture;
+            }
+        }
+    } else {
+        InsertRecordCall(ins, IPOINT_BEFORE)(
+            ins, IPOINT_BEFORE,
+            (AFUNPTR)RecordNoMemAccess,
+            IARG_REG_VALUE, scratchReg,
+            IARG_INST_PTR,
+            IARG_END
+        );
+    }
+
+    IPOINT ipoint;
+    if (!capture || !ValuePoint(ins, ipoint)) {
+        return;
+    }
 
-    cerr << KNOB_BASE::StringKnobSummary() << endl;
+    // written values are read once the instruction has executed
+    if (captureWrite) {
+        InsertRecordCall(ins, ipoint)(
+            ins, ipoint,
+            (AFUNPTR)CaptureWrittenMem,
+            IARG_REG_VALUE, scratchReg,
+            IARG_INST_PTR,
+            IARG_END
+        );
+    }
 
-    return -1;
+    vector<UINT32> regs = CapturedRegs(ins);
+    for (size_t i = 0; i < regs.size(); i++) {
+        InsertRecordCall(ins, ipoint)(
+            ins, ipoint,
+            (AFUNPTR)CaptureRegValue,
+            IARG_REG_VALUE, scratchReg,
+            IARG_INST_PTR,
+            IARG_UINT32, regs[i],
+            IARG_REG_VALUE, INS_RegW(ins, regs[i]),
+            IARG_END
+        );
+    }
 }
 
-// map to hold the running logs for each instruction
-std::map<ADDRINT, std::string> insLogs;
+// instrument a block which accesses memory or captures values, instruction by instruction
+VOID InstrumentRecords(BBL bbl, BlockLog* block) {
+    InsertSampling(BBL_InsHead(bbl), block);
 
-// order to track the how the instructions are processed
-int order = 0;
+    // reserve room for the whole block at its head, except that REP instructions
+    // record once per iteration, so they reserve for themselves and split the block
+    INS segHead = BBL_InsHead(bbl);
+    UINT32 segRecords = 0;
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+        if (INS_HasRealRep(ins)) {
+            if (segRecords > 0) {
+                InsertReserve(segHead, segRecords);
+            }
+            InsertReserve(ins, RecordsPerExecution(ins));
+            segHead = INS_Next(ins);
+            segRecords = 0;
+        } else {
+            segRecords += RecordsPerExecution(ins);
+        }
+    }
+    if (segRecords > 0) {
+        InsertReserve(segHead, segRecords);
+    }
 
-// a util map to recover mem easier, record all mem access
-std::map<ADDRINT, UINT32> memSet;
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+        InstrumentIns(ins);
+    }
+}
 
-// return the string format of the log of a memory access
-std::string getMemLog(char rw, ADDRINT addr, UINT32 size) {
-    std::ostringstream detailStream;
-    detailStream << "        [" << order++ << "] " << " -" << rw << "-> " << std::hex << addr << " <" << size << ">" << endl;
-    return detailStream.str();
+// whether `ins` writes any part of the full register `full`
+BOOL WritesFullReg(INS ins, REG full) {
+    for (UINT32 i = 0; i < INS_MaxNumWRegs(ins); i++) {
+        if (REG_FullRegName(INS_RegW(ins, i)) == full) {
+            return TRUE;
+        }
+    }
+    return FALSE;
 }
 
-// inserted for instructions which read memory
-VOID RecordMemRead(ADDRINT ip, ADDRINT addr, UINT32 size) {
-    insLogs[ip] += getMemLog('r', addr, size);
+// static type hints for the access of `ins` through memory operand `memOp`
+UINT32 AccessHints(INS ins, UINT32 memOp) {
+    const InsLog& insLog = *insLogs.find(INS_Address(ins));
+    UINT32 hints = 0;
+
+    if (insLog.readsFloat || insLog.writesFloat) {
+        hints |= HINT_FLOAT;
+    }
+    if (INS_IsRet(ins)) {
+        hints |= HINT_RETURN_ADDR;
+    }
+
+    // PUSH rbp stores and POP rbp reloads the caller's frame pointer
+    const vector<REG>& regs = insLog.mnemonic == "PUSH" ? insLog.readRegs : insLog.writeRegs;
+    if ((insLog.mnemonic == "PUSH" || insLog.mnemonic == "POP") &&
+            std::find(regs.begin(), regs.end(), REG_GBP) != regs.end()) {
+        hints |= HINT_SAVED_FP;
+    }
 
-    memSet[addr] = size;
+    // a loaded value used as the base or index of a later access in the block is a pointer,
+    // as long as the register still holds it
+    if (INS_MemoryOperandIsRead(ins, memOp) && insLog.writeRegs.size() == 1) {
+        REG loaded = REG_FullRegName(insLog.writeRegs[0]);
+        for (INS next = INS_Next(ins); INS_Valid(next) && !(hints & HINT_POINTER); next = INS_Next(next)) {
+            for (UINT32 op = 0; op < INS_MemoryOperandCount(next); op++) {
+                if (REG_FullRegName(INS_OperandMemoryBaseReg(next, op)) == loaded ||
+                        REG_FullRegName(INS_OperandMemoryIndexReg(next, op)) == loaded) {
+                    hints |= HINT_POINTER;
+                }
+            }
+            // the address is formed before the write, so mov rax, [rax] still counts
+            if (WritesFullReg(next, loaded)) {
+                break;
+            }
+        }
+    }
+    return hints;
 }
 
-// inserted for instructions which write memory
-VOID RecordMemWrite(ADDRINT ip, ADDRINT addr, UINT32 size) {
-    insLogs[ip] += getMemLog('w', addr, size);
+// track frames and attribute the stack accesses of `ins` to them
+VOID InstrumentLayout(INS ins) {
+    ADDRINT addr = INS_Address(ins);
+
+    RTN rtn = RTN_FindByAddress(addr);
+    if (RTN_Valid(rtn) && RTN_Address(rtn) == addr) {
+        PIN_GetLock(&logLock, PIN_ThreadId() + 1);
+        functionNames[addr] = RTN_Name(rtn);
+        PIN_ReleaseLock(&logLock);
+
+        INS_InsertCall(
+            ins, IPOINT_BEFORE,
+            (AFUNPTR)EnterFrame,
+            IARG_REG_VALUE, scratchReg,
+            IARG_ADDRINT, addr,
+            IARG_REG_VALUE, REG_STACK_PTR,
+            IARG_END
+        );
+    }
+
+    // the return address pushed by a CALL belongs to the callee, which records it on entry
+    UINT32 memOperands = INS_IsCall(ins) ? 0 : INS_MemoryOperandCount(ins);
+    for (UINT32 memOp = 0; memOp < memOperands; memOp++) {
+        if (!INS_MemoryOperandIsRead(ins, memOp) && !INS_MemoryOperandIsWritten(ins, memOp)) {
+            continue;
+        }
+        INS_InsertCall(
+            ins, IPOINT_BEFORE,
+            (AFUNPTR)FrameAccess,
+            IARG_REG_VALUE, scratchReg,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_UINT32, INS_MemoryOperandSize(ins, memOp),
+            IARG_UINT32, AccessHints(ins, memOp),
+            IARG_END
+        );
+    }
 
-    memSet[addr] = size;
+    if (INS_IsRet(ins)) {
+        INS_InsertCall(
+            ins, IPOINT_BEFORE,
+            (AFUNPTR)LeaveFrame,
+            IARG_REG_VALUE, scratchReg,
+            IARG_REG_VALUE, REG_STACK_PTR,
+            IARG_END
+        );
+    }
 }
 
-// inserted for instruction which do not access memory
-VOID RecordNoMemAccess(ADDRINT ip) {
-    std::ostringstream detailStream;
-    detailStream << "        [" << order++ << "] " << " no mem access" << endl;
-    insLogs[ip] += detailStream.str();
+// find or create the block log of bbl, caller holds logLock
+BlockLog* GetBlockLog(BBL bbl) {
+    BlockLog*& block = blockLogs[std::make_pair(BBL_Address(bbl), BBL_NumIns(bbl))];
+    if (block == 0) {
+        block = new BlockLog;
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+            block->ips.push_back(INS_Address(ins));
+        }
+        block->end = INS_Address(BBL_InsTail(bbl)) + INS_Size(BBL_InsTail(bbl));
+        block->id = blockList.size();
+        RTN rtn = RTN_FindByAddress(BBL_Address(bbl));
+        block->func = RTN_Valid(rtn) ? RTN_Name(rtn) : "?";
+        blockList.push_back(block);
+    }
+    return block;
 }
 
+VOID InstrumentBlock(BBL bbl) {
+    PIN_GetLock(&logLock, PIN_ThreadId() + 1);
+    BlockLog* block = GetBlockLog(bbl);
 
-VOID Instruction(INS ins, VOID *v) {
-    //https://software.intel.com/sites/landingpage/pintool/docs/97619/Pin/html/group__INS__BASIC__API__GEN__IA32.html
-    string strInst = INS_Mnemonic(ins);
-    ADDRINT addr = INS_Address(ins);
+    if (KnobDetachIns > 0) {
+        InsertDetachCheck(BBL_InsHead(bbl), block);
+    }
+
+    if (KnobProfile) {
+        // counting alone, nothing is decoded or recorded
+        PIN_ReleaseLock(&logLock);
+        InsertCounting(BBL_InsHead(bbl), block);
+        return;
+    }
 
-    // BOOL isCall = INS_IsCall(ins);
-    // BOOL isRet = INS_IsRet(ins);
+    // blocks which access memory or capture values record per instruction
+    BOOL hasMem = FALSE;
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+        DecodeIns(ins);
+        if (INS_MemoryOperandCount(ins) > 0 || CapturesValues(ins)) {
+            hasMem = TRUE;
+        }
+    }
+    PIN_ReleaseLock(&logLock);
 
-    if( g_bMainExecLoaded ) { // if the main module is not loaded, we don’t need to trace any.
-        if( g_addrLow <= addr && addr <= g_addrHigh ) {
-            std::ostringstream detailStream;
-            detailStream << std::hex << addr << " " << strInst;
+    if (!hasMem) {
+        // fast path: one room check and one call for the whole block
+        INS head = BBL_InsHead(bbl);
+        InsertSampling(head, block);
+        InsertReserve(head, block->ips.size());
+        InsertRecordCall(head, IPOINT_BEFORE)(
+            head, IPOINT_BEFORE,
+            (AFUNPTR)RecordBlock,
+            IARG_REG_VALUE, scratchReg,
+            IARG_PTR, block,
+            IARG_END
+        );
+    } else {
+        InstrumentRecords(bbl, block);
+    }
 
+    if (!KnobLayout.Value().empty()) {
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+            InstrumentLayout(ins);
+        }
+    }
+}
 
-            UINT32 memOperands = INS_MemoryOperandCount(ins);
-            UINT32 memRRegs = INS_MaxNumRRegs(ins);
-            UINT32 memWRegs = INS_MaxNumWRegs(ins);
+/* ===================================================================== */
+// Selective instrumentation
+/* ===================================================================== */
 
-            if (memRRegs > 0) {
-                detailStream << " -r->";
-                for( UINT32 i=0; i < memRRegs; i++ ) {
-                    REG reg = INS_RegR(ins, i);
-                    detailStream << " " << REG_StringShort(reg);
-                    if ( REG_is_fr( reg ) ) {
-                        detailStream << " (float)";
-                    }
-                }
-            }
-            if (memWRegs > 0) {
-                detailStream << " -w->";
-                for( UINT32 i=0; i < memWRegs; i++ ) {
-                    REG reg = INS_RegW(ins, i);
-                    detailStream << " " << REG_StringShort(reg);
-                    if ( REG_is_fr( reg ) ) {
-                        detailStream << " (float)";
-                    }
-                }
-            }
+// shared libraries traced in addition to Main, from -lib
+vector<string> tracedLibs;
+vector<AddrRange> libRanges;
 
-            detailStream << endl;
+// functions named by -func
+vector<string> tracedFuncNames;
 
-            // some instruction will be instrued multiple times, no idea why
-            // so check here and only log once
-            if (insLogs.count(addr) == 0) {
-                insLogs[addr] = detailStream.str();
+// code of the functions named by -func, found when their image loads
+vector<AddrRange> funcRanges;
+
+// explicit ranges from -range
+vector<AddrRange> codeRanges;
+
+// whether code at addr is traced; checked at instrumentation time, so the rest runs natively
+BOOL IsTraced(ADDRINT addr) {
+    // -func and -range select the code to trace, wherever it is
+    if (!funcRanges.empty() || !codeRanges.empty()) {
+        return InRanges(funcRanges, addr) || InRanges(codeRanges, addr);
+    }
+    if (!tracedFuncNames.empty()) {
+        // none of the named functions is loaded yet
+        return FALSE;
+    }
+
+    return (g_addrLow <= addr && addr <= g_addrHigh) || InRanges(libRanges, addr);
+}
+
+VOID Trace(TRACE trace, VOID *v) {
+    if( !g_bMainExecLoaded ) { // if the main module is not loaded, we don’t need to trace any.
+        return;
+    }
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+        // Do not log anything happens outside of the traced code
+        BOOL traced = IsTraced(BBL_Address(bbl));
+        if( traced ) {
+            InstrumentBlock(bbl);
+        }
+
+        // taint flows through all code, e.g. a library memcpy, but is only reported in traced code
+        if (!KnobTaint.Value().empty()) {
+            for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+                InstrumentTaint(ins, traced);
             }
+        }
+    }
+}
 
+// record the code of the functions named by -func in a newly loaded image
+VOID FindTracedFuncs(IMG img) {
+    for (SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec)) {
+        for (RTN rtn = SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn)) {
+            string name = PIN_UndecorateSymbolName(RTN_Name(rtn), UNDECORATION_NAME_ONLY);
 
-            if (memOperands > 0) {
-                // Iterate over each memory operand of the instruction.
-                for (UINT32 memOp = 0; memOp < memOperands; memOp++) {
-                    if (INS_MemoryOperandIsRead(ins, memOp)) {
-                        INS_InsertCall(
-                            ins, IPOINT_BEFORE,
-                            (AFUNPTR)RecordMemRead,
-                            IARG_INST_PTR,
-                            IARG_MEMORYOP_EA, memOp,
-                            IARG_MEMORYREAD_SIZE,
-                            IARG_END
-                        );
-                    } else if (INS_MemoryOperandIsWritten(ins, memOp)) {
-                        INS_InsertCall(
-                            ins, IPOINT_BEFORE,
-                            (AFUNPTR)RecordMemWrite,
-                            IARG_INST_PTR,
-                            IARG_MEMORYOP_EA, memOp,
-                            IARG_MEMORYWRITE_SIZE,
-                            IARG_END
-                        );
-                    }
+            for (size_t i = 0; i < tracedFuncNames.size(); i++) {
+                if (name == tracedFuncNames[i] || RTN_Name(rtn) == tracedFuncNames[i]) {
+                    funcRanges.push_back(AddrRange(RTN_Address(rtn), RTN_Address(rtn) + RTN_Size(rtn)));
                 }
-            } else {
-                INS_InsertCall(
-                    ins, IPOINT_BEFORE,
-                    (AFUNPTR)RecordNoMemAccess,
-                    IARG_INST_PTR,
-                    IARG_END
-                );
             }
-        } else {
-            // Do not log anything happens outside of Main
-            // printf("[2] %llx %s\n", addr, strInst.c_str());
         }
-    } else {
-        // Do not log anything happens before Main is loaded
-        // printf("[3] %llx %s\n", addr, strInst.c_str());
     }
 }
 
@@ -184,7 +2030,197 @@ VOID ImageLoad(IMG img, VOID *v) {
 
         // Use the above addresses to prune out non-interesting instructions.
         g_bMainExecLoaded = TRUE;
+    } else {
+        for (size_t i = 0; i < tracedLibs.size(); i++) {
+            if (IMG_Name(img).find(tracedLibs[i]) != string::npos) {
+                libRanges.push_back(AddrRange(IMG_LowAddress(img), IMG_HighAddress(img) + 1));
+                break;
+            }
+        }
+    }
+
+    if (!tracedFuncNames.empty()) {
+        FindTracedFuncs(img);
+    }
+    if (!KnobHeap.Value().empty()) {
+        InstrumentAllocators(img);
+    }
+    if (!KnobTaint.Value().empty()) {
+        InstrumentTaintMarks(img);
+    }
+}
+
+// dump the instruction table and the raw records, decoded offline by tracedecode
+VOID WriteBinaryTrace() {
+    WriteTraceHeader();
+
+    vector<uint64_t> insVector;
+    insLogs.sortedKeys(insVector);
+    std::string insChunk = EncodeInsChunk(insVector);
+    out->write(insChunk.data(), insChunk.size());
+
+    size_t rec = 0;
+    for(size_t i = 0; i < traceChunks.size(); i++) {
+        WriteRecChunk(traceChunks[i].tid, &traceRecords[rec], traceChunks[i].count);
+        rec += traceChunks[i].count;
+    }
+    out->flush();
+}
+
+// print the recovered frame layout of each traced function, by function address
+VOID WriteLayouts() {
+    std::ofstream layoutOut(OutputName(KnobLayout.Value()).c_str());
+
+    vector<uint64_t> funcs;
+    frameLayouts.sortedKeys(funcs);
+    for (size_t i = 0; i < funcs.size(); i++) {
+        const FunctionLayout& layout = **frameLayouts.find(funcs[i]);
+        const string* name = functionNames.find(funcs[i]);
+
+        layoutOut << (name ? *name : "?") << " (" << std::hex << funcs[i] << "), "
+                  << std::dec << layout.calls << " calls" << endl;
+        layout.print(layoutOut);
+        layoutOut << endl;
+    }
+}
+
+// executed instructions of a block, for ranking
+struct HotBlock {
+    UINT64 instructions;
+    const BlockLog* block;
+
+    bool operator<(const HotBlock& other) const {
+        return instructions > other.instructions;
+    }
+};
+
+// total the block counters and list the blocks which executed the most instructions,
+// with their code range in the form taken by -range
+VOID WriteProfile(std::ostream& profileOut) {
+    vector<HotBlock> hot;
+    for (size_t i = 0; i < blockList.size() && i < blockCounts.size(); i++) {
+        const BlockLog* block = blockList[i];
+        bblCount += blockCounts[i];
+        insCount += blockCounts[i] * block->ips.size();
+
+        if (blockCounts[i] > 0) {
+            HotBlock entry;
+            entry.instructions = blockCounts[i] * block->ips.size();
+            entry.block = block;
+            hot.push_back(entry);
+        }
+    }
+
+    size_t shown = hot.size() < KnobHot.Value() ? hot.size() : KnobHot.Value();
+    std::partial_sort(hot.begin(), hot.begin() + shown, hot.end());
+
+    profileOut <<  "===============================================" << endl;
+    profileOut <<  "MyPinTool analysis results: " << endl;
+    profileOut <<  "Number of instructions: " << std::dec << insCount  << endl;
+    profileOut <<  "Number of basic blocks: " << bblCount  << endl;
+    profileOut <<  "Number of threads: " << threadCount  << endl;
+    profileOut <<  "===============================================" << endl;
+
+    for (size_t i = 0; i < shown; i++) {
+        const BlockLog* block = hot[i].block;
+        profileOut << std::dec << hot[i].instructions * 100 / (insCount ? insCount : 1) << "% "
+                   << hot[i].instructions << " instructions, "
+                   << blockCounts[block->id] << " executions  "
+                   << std::hex << block->ips[0] << ":" << block->end << "  "
+                   << block->func << endl;
+    }
+    profileOut << std::dec;
+}
+
+// text of the instruction at ip for the reports, its address if it was not decoded
+std::string DescribeIns(uint64_t ip) {
+    const InsLog* insLog = insLogs.find(ip);
+    if (insLog) {
+        return insLog->text;
+    }
+    std::ostringstream ipStream;
+    ipStream << std::hex << ip << endl;
+    return ipStream.str();
+}
+
+// print the misses of each simulated level and the instructions causing them
+VOID WriteCacheReport() {
+    std::ofstream cacheFile;
+    if (!KnobCacheOut.Value().empty()) {
+        cacheFile.open(OutputName(KnobCacheOut.Value()).c_str());
+    }
+    std::ostream& cacheOut = KnobCacheOut.Value().empty() ? cerr : cacheFile;
+
+    cacheSim.print(cacheOut, KnobHot.Value(), DescribeIns);
+}
+
+// print the allocation sites, each with its address and routine
+VOID WriteHeapReport() {
+    std::ofstream heapOut(OutputName(KnobHeap.Value()).c_str());
+    heapTracker.replay(~(UINT64)0);
+    heapTracker.finish();
+
+    PIN_LockClient();
+    heapTracker.print(heapOut, [](uint64_t site) -> std::string {
+        RTN rtn = RTN_FindByAddress(site);
+        std::ostringstream siteStream;
+        siteStream << std::hex << site << " " << (RTN_Valid(rtn) ? RTN_Name(rtn) : "?") << endl;
+        return siteStream.str();
+    });
+    PIN_UnlockClient();
+}
+
+// print the reuse distance histograms and the working set over time
+VOID WriteReuseReport() {
+    std::ofstream reuseOut(OutputName(KnobReuse.Value()).c_str());
+    reuseProfiler->finish();
+    reuseProfiler->print(reuseOut, DescribeIns);
+}
+
+// print the taint sources and every traced instruction which read tainted data
+VOID WriteTaintReport() {
+    std::ofstream taintOut(OutputName(KnobTaint.Value()).c_str());
+    taintOut << std::dec << taintedByInput << " bytes tainted by input syscalls, "
+             << taintedByMarks << " by marks, " << taintMemory.tainted() << " tainted at exit" << endl;
+    taintOut << "===============================================" << endl;
+    taintOut << "Instructions reading tainted data by address" << endl;
+    taintOut << "===============================================" << endl;
+
+    vector<uint64_t> ips;
+    taintInsLogs.sortedKeys(ips);
+    for (size_t i = 0; i < ips.size(); i++) {
+        const TaintIns* ti = *taintInsLogs.find(ips[i]);
+        if (ti->consumed > 0) {
+            taintOut << std::dec << ti->consumed << " tainted executions  " << DescribeIns(ips[i]);
+        }
+    }
+}
+
+// print the records of each thread in execution order, see trace_flow.h
+VOID WriteFlowView() {
+    FlowTable table;
+    vector<uint64_t> insVector;
+    insLogs.sortedKeys(insVector);
+    for (size_t i = 0; i < insVector.size(); i++) {
+        table.add(insVector[i], insLogs[insVector[i]].flags);
+    }
+
+    // the chunks tell which thread each run of records came from
+    std::map<UINT32, vector<TraceRecord> > threads;
+    size_t first = 0;
+    for (size_t i = 0; i < traceChunks.size(); i++) {
+        vector<TraceRecord>& records = threads[traceChunks[i].tid];
+        records.insert(records.end(), traceRecords.begin() + first, traceRecords.begin() + first + traceChunks[i].count);
+        first += traceChunks[i].count;
     }
+
+    PIN_LockClient();
+    printFlowView(*out, threads, table, [](uint64_t ip) -> std::string {
+        std::ostringstream entryStream;
+        entryStream << std::hex << ip << " " << RTN_FindNameByAddress(ip);
+        return entryStream.str();
+    });
+    PIN_UnlockClient();
 }
 
 /*!
@@ -195,28 +2231,240 @@ VOID ImageLoad(IMG img, VOID *v) {
  *                              PIN_AddFiniFunction function call
  */
 VOID Fini(INT32 code, VOID *v) {
-    vector<ADDRINT> insVector;
-    for(map<ADDRINT, std::string>::iterator it = insLogs.begin(); it != insLogs.end(); ++it) {
-        insVector.push_back(it->first);
+    if (!KnobTaint.Value().empty()) {
+        WriteTaintReport();
+    }
+
+    if (KnobProfile) {
+        WriteProfile(*out);
+        return;
+    }
+
+    if (cacheSim.enabled()) {
+        WriteCacheReport();
+    }
+    if (reuseProfiler) {
+        WriteReuseReport();
+    }
+    if (!KnobHeap.Value().empty()) {
+        WriteHeapReport();
+    }
+
+    if (!KnobLayout.Value().empty()) {
+        WriteLayouts();
     }
-    std::sort(insVector.begin(), insVector.end());
 
+    if (KnobStream) {
+        // the records are streamed already, only instructions instrumented late are left
+        WriteNewIns();
+        out->flush();
+        return;
+    }
+
+    if (KnobBinary) {
+        WriteBinaryTrace();
+        return;
+    }
+
+    *out << getSamplingLog(sampling);
+
+    if (KnobFlow) {
+        WriteFlowView();
+        return;
+    }
+
+    // group the records by instruction, keeping the execution order inside a group
+    std::sort(traceRecords.begin(), traceRecords.end(), traceRecordByIp);
+
+    vector<uint64_t> insVector;
+    insLogs.sortedKeys(insVector);
+
+    size_t rec = 0;
     for(size_t i = 0; i < insVector.size(); i++) {
-        *out << insLogs[insVector[i]];
+        *out << insLogs[insVector[i]].text;
+
+        for (; rec < traceRecords.size() && traceRecords[rec].ip <= insVector[i]; rec++) {
+            if (traceRecords[rec].ip == insVector[i]) {
+                *out << getRecordLog(traceRecords[rec], insLogs[insVector[i]].text);
+            }
+        }
     }
 
     *out <<  "===============================================" << endl;
     *out <<  "All memeory address accessed by the instructions" << endl;
     *out <<  "===============================================" << endl;
 
-    vector<ADDRINT> memVector;
-    for(map<ADDRINT, UINT32>::iterator it = memSet.begin(); it != memSet.end(); ++it) {
-        memVector.push_back(it->first);
+    if (KnobRanges) {
+        memSet.forEachRange([](uint64_t start, uint64_t end) {
+            *out << std::hex << start << " - " << end << " <" << end - start << ">" << endl;
+        });
+    } else {
+        memSet.forEach([](uint64_t addr, uint32_t size) {
+            *out << std::hex << addr << " " << size << endl;
+        });
+    }
+}
+
+/* ===================================================================== */
+// Fork, exec and detach
+/* ===================================================================== */
+
+// the pin command line up to "--"
+vector<string> pinArgs;
+
+VOID InitLocks() {
+    PIN_InitLock(&logLock);
+    PIN_InitLock(&queueLock);
+    PIN_InitLock(&outLock);
+    PIN_InitLock(&cacheLock);
+    PIN_InitLock(&reuseLock);
+    PIN_InitLock(&heapLock);
+}
+
+// hand the forking thread's records to the parent and hold every lock, so the
+// child gets a consistent copy of the tool state and an empty output buffer
+VOID ForkBefore(THREADID tid, const CONTEXT *ctxt, VOID *v) {
+    ThreadLog* tl = static_cast<ThreadLog*>(PIN_GetThreadData(tlsKey, tid));
+    FlushThreadLog(tl);
+
+    PIN_GetLock(&outLock, tid + 1);
+    PIN_GetLock(&logLock, tid + 1);
+    PIN_GetLock(&queueLock, tid + 1);
+    PIN_GetLock(&cacheLock, tid + 1);
+    PIN_GetLock(&reuseLock, tid + 1);
+    PIN_GetLock(&heapLock, tid + 1);
+    out->flush();
+}
+
+VOID ForkParent(THREADID tid, const CONTEXT *ctxt, VOID *v) {
+    PIN_ReleaseLock(&heapLock);
+    PIN_ReleaseLock(&reuseLock);
+    PIN_ReleaseLock(&queueLock);
+    PIN_ReleaseLock(&cacheLock);
+    PIN_ReleaseLock(&logLock);
+    PIN_ReleaseLock(&outLock);
+}
+
+// the child only reports what it runs after the fork, into files suffixed with its pid.
+// Only the forking thread exists in the child; the state of the others is dropped.
+VOID ForkChild(THREADID tid, const CONTEXT *ctxt, VOID *v) {
+    InitLocks();
+
+    std::ostringstream suffix;
+    suffix << outputSuffix << "." << PIN_GetPid();
+    outputSuffix = suffix.str();
+
+    ThreadLog* tl = static_cast<ThreadLog*>(PIN_GetThreadData(tlsKey, tid));
+    for (size_t i = 0; i < threadLogs.size(); i++) {
+        if (threadLogs[i] != tl) {
+            delete threadLogs[i]->frames;
+            delete[] threadLogs[i]->blockCounts;
+            delete[] threadLogs[i]->regTaint;
+            delete threadLogs[i];
+        }
+    }
+    threadLogs.assign(1, tl);
+    threadCount = 1;
+
+    traceRecords.clear();
+    traceChunks.clear();
+    memSet.clear();
+    blockCounts.clear();
+    std::fill(tl->blockCounts, tl->blockCounts + tl->blockCap, 0);
+
+    vector<uint64_t> funcs;
+    frameLayouts.sortedKeys(funcs);
+    for (size_t i = 0; i < funcs.size(); i++) {
+        delete *frameLayouts.find(funcs[i]);
+    }
+    frameLayouts = AddrTable<FunctionLayout*>();
+    if (tl->frames) {
+        tl->frames->clearLayouts();
+    }
+
+    cacheSim.resetCounts();
+    if (reuseProfiler) {
+        reuseProfiler->resetCounts();
+    }
+    // the events held back for the other threads happened before the fork
+    heapTracker.replay(~(UINT64)0);
+    heapTracker.resetCounts();
+
+    // the child's memory is a copy of the parent's, so is its taint
+    taintedByInput = 0;
+    taintedByMarks = 0;
+    vector<uint64_t> taintIps;
+    taintInsLogs.sortedKeys(taintIps);
+    for (size_t i = 0; i < taintIps.size(); i++) {
+        (*taintInsLogs.find(taintIps[i]))->consumed = 0;
+    }
+
+    if (out != &cerr) {
+        delete out;
+        out = new std::ofstream(OutputName(KnobOutputFile.Value()).c_str(), std::ios::out | std::ios::binary);
+    }
+
+    if (KnobStream) {
+        // the parent's writer did not survive the fork, the child starts its own trace
+        writeQueue.clear();
+        for (UINT32 i = 0; i < 2; i++) {
+            PIN_SemaphoreSet(&tl->bufferFree[i]);
+        }
+        newIns.clear();
+        insLogs.sortedKeys(newIns);
+        WriteTraceHeader();
+        if (!StartWriter()) {
+            writerRunning = FALSE;
+        }
+    }
+}
+
+// trace the program an exec starts as well, writing to files with an ".exec" suffix
+BOOL FollowChild(CHILD_PROCESS child, VOID *v) {
+    vector<string> args;
+    for (size_t i = 0; i < pinArgs.size(); i++) {
+        if (pinArgs[i] == "-suffix") {
+            i++;
+        } else {
+            args.push_back(pinArgs[i]);
+        }
+    }
+    args.push_back("-suffix");
+    args.push_back(outputSuffix + ".exec");
+    args.push_back("--");
+
+    // Pin copies the command line before this returns
+    vector<const CHAR*> argv;
+    for (size_t i = 0; i < args.size(); i++) {
+        argv.push_back(args[i].c_str());
+    }
+    CHILD_PROCESS_SetPinCommandLine(child, argv.size(), &argv[0]);
+    return TRUE;
+}
+
+// internal thread detaching after -detach_sec
+VOID DetachTimer(VOID *arg) {
+    for (UINT32 slept = 0; slept < KnobDetachSec * 1000; slept += WRITER_PERIOD_MS) {
+        if (PIN_IsProcessExiting()) {
+            return;
+        }
+        PIN_Sleep(WRITER_PERIOD_MS);
+    }
+    if (__sync_bool_compare_and_swap(&detachRequested, FALSE, TRUE)) {
+        PIN_Detach();
+    }
+}
+
+// Fini is not called after a detach. The application runs natively by now, so
+// the buffers of the threads still alive are complete and can be written here.
+VOID DetachTool(VOID *v) {
+    if (KnobStream) {
+        PrepareForFini(0);
     }
-    std::sort(memVector.begin(), memVector.end());
-    for(size_t i = 0; i < memVector.size(); i++) {
-        *out << std::hex << memVector[i] << " " << memSet[memVector[i]] << endl;
+    while (!threadLogs.empty()) {
+        FinishThreadLog(threadLogs.back());
     }
+    Fini(0, 0);
 }
 
 /*!
@@ -233,9 +2481,141 @@ int main(int argc, char *argv[]) {
         return Usage();
     }
 
-    string fileName = KnobOutputFile.Value();
+    outputSuffix = KnobSuffix.Value();
+    string fileName = OutputName(KnobOutputFile.Value());
+
+    // the pin command line up to "--", repeated for the processes an exec starts
+    for (int i = 0; i < argc && string(argv[i]) != "--"; i++) {
+        pinArgs.push_back(argv[i]);
+    }
+
+    if (KnobProfile && (KnobBinary || KnobStream)) {
+        cerr << "-profile writes a text report and cannot be combined with -binary or -stream" << endl;
+        return Usage();
+    }
+
+    if (KnobFlow && (KnobBinary || KnobStream || KnobProfile)) {
+        cerr << "-flow is a text view, use tracedecode -flow for -binary and -stream traces" << endl;
+        return Usage();
+    }
+
+    if (KnobCompress && !KnobBinary && !KnobStream) {
+        cerr << "-compress applies to the records of -binary and -stream traces" << endl;
+        return Usage();
+    }
+
+    if ((KnobBinary || KnobStream) && fileName.empty()) {
+        cerr << "-binary and -stream need an output file given by -o" << endl;
+        return Usage();
+    }
+
+    if (!fileName.empty()) { out = new std::ofstream(fileName.c_str(), std::ios::out | std::ios::binary);}
+
+    InitLocks();
+
+    vector<string> ranges = AppendedValues(KnobValueRange);
+    for (size_t i = 0; i < ranges.size(); i++) {
+        ADDRINT low, high;
+        if (!ParseRange(ranges[i], low, high)) {
+            cerr << "Invalid -value_range " << ranges[i] << endl;
+            return Usage();
+        }
+        valueRanges.push_back(AddrRange(low, high));
+    }
+    valueClasses = AppendedValues(KnobValueClass);
+
+    ranges = AppendedValues(KnobRange);
+    for (size_t i = 0; i < ranges.size(); i++) {
+        ADDRINT low, high;
+        if (!ParseRange(ranges[i], low, high)) {
+            cerr << "Invalid -range " << ranges[i] << endl;
+            return Usage();
+        }
+        codeRanges.push_back(AddrRange(low, high));
+    }
+    tracedFuncNames = AppendedValues(KnobFunc);
+    tracedLibs = AppendedValues(KnobLib);
+
+    vector<string> caches = AppendedValues(KnobCache);
+    for (size_t i = 0; i < caches.size(); i++) {
+        CacheConfig config;
+        if (!parseCacheConfig(caches[i], config, false) || !cacheSim.addLevel(config)) {
+            cerr << "Invalid -cache " << caches[i] << ", expected size:assoc:line[:policy], "
+                 << "at most " << CacheSimulator::MAX_LEVELS << " levels" << endl;
+            return Usage();
+        }
+    }
+    if (!KnobTlb.Value().empty()) {
+        CacheConfig config;
+        if (!parseCacheConfig(KnobTlb.Value(), config, true)) {
+            cerr << "Invalid -tlb " << KnobTlb.Value() << ", expected entries:assoc:page[:policy]" << endl;
+            return Usage();
+        }
+        cacheSim.setTlb(config);
+    }
+
+    if (!KnobReuse.Value().empty()) {
+        UINT32 line = KnobReuseLine.Value();
+        if (line == 0 || (line & (line - 1)) != 0 || KnobWindow.Value() == 0) {
+            cerr << "-reuse_line must be a power of two and -window positive" << endl;
+            return Usage();
+        }
+        reuseProfiler = new ReuseProfiler(line, KnobWindow.Value());
+    }
+
+    vector<string> fds = AppendedValues(KnobTaintFd);
+    for (size_t i = 0; i < fds.size(); i++) {
+        std::istringstream fdStream(fds[i]);
+        ADDRINT fd;
+        if (!(fdStream >> fd)) {
+            cerr << "Invalid -taint_fd " << fds[i] << endl;
+            return Usage();
+        }
+        taintFds.push_back(fd);
+    }
+    ranges = AppendedValues(KnobTaintRange);
+    for (size_t i = 0; i < ranges.size(); i++) {
+        ADDRINT low, high;
+        if (!ParseRange(ranges[i], low, high)) {
+            cerr << "Invalid -taint_range " << ranges[i] << endl;
+            return Usage();
+        }
+        TaintSource(0, low, high - low, taintedByMarks);
+    }
+    if (KnobTaint.Value().empty() && (!fds.empty() || !ranges.empty() || !AppendedValues(KnobTaintMark).empty())) {
+        cerr << "-taint_fd, -taint_range and -taint_mark need -taint" << endl;
+        return Usage();
+    }
+
+    sampling.period = KnobSample.Value();
+    if (sampling.period == 0) {
+        cerr << "-sample must be at least 1" << endl;
+        return Usage();
+    }
+    sampling.burstOn = 0;
+    sampling.burstOff = 0;
+    sampling.reserved = 0;
+    if (!KnobBurst.Value().empty()) {
+        std::istringstream burstStream(KnobBurst.Value());
+        char colon = 0;
+        if (!(burstStream >> sampling.burstOn >> colon >> sampling.burstOff) || colon != ':' ||
+                sampling.burstOn == 0) {
+            cerr << "Invalid -burst " << KnobBurst.Value() << ", expected on:off" << endl;
+            return Usage();
+        }
+        if (sampling.period > 1) {
+            cerr << "-sample and -burst cannot be combined" << endl;
+            return Usage();
+        }
+    }
 
-    if (!fileName.empty()) { out = new std::ofstream(fileName.c_str());}
+    // every thread gets its own trace buffer, reachable through TLS and a tool register
+    tlsKey = PIN_CreateThreadDataKey(0);
+    scratchReg = PIN_ClaimToolRegister();
+    if (!REG_valid(scratchReg)) {
+        cerr << "Cannot allocate a scratch register for the thread buffers" << endl;
+        return 1;
+    }
 
     if (KnobCount) {
         // On OS X*, you must initially do PIN_InitSymbols() if you want to use IMG_AddInstrumentFunction()
@@ -244,8 +2624,39 @@ int main(int argc, char *argv[]) {
         // Register ImageLoad to be called when an image is loaded
         IMG_AddInstrumentFunction(ImageLoad, 0);
 
-        // Register Instruction to be called to instrument instructions
-        INS_AddInstrumentFunction(Instruction, 0);
+        // Register Trace to be called to instrument basic blocks
+        TRACE_AddInstrumentFunction(Trace, 0);
+
+        // Register functions to set up and flush the buffer of each thread
+        PIN_AddThreadStartFunction(ThreadStart, 0);
+        PIN_AddThreadFiniFunction(ThreadFini, 0);
+
+        if (!KnobTaint.Value().empty()) {
+            PIN_AddSyscallEntryFunction(TaintSyscallEntry, 0);
+            PIN_AddSyscallExitFunction(TaintSyscallExit, 0);
+        }
+
+        if (KnobStream) {
+            // records are written by a background thread while the application runs
+            WriteTraceHeader();
+            if (!StartWriter()) {
+                cerr << "Cannot start the trace writer thread" << endl;
+                return 1;
+            }
+            PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
+        }
+
+        // children get their own output files, see ForkChild and FollowChild
+        PIN_AddForkFunction(FPOINT_BEFORE, ForkBefore, 0);
+        PIN_AddForkFunction(FPOINT_AFTER_IN_PARENT, ForkParent, 0);
+        PIN_AddForkFunction(FPOINT_AFTER_IN_CHILD, ForkChild, 0);
+        PIN_AddFollowChildProcessFunction(FollowChild, 0);
+
+        PIN_AddDetachFunction(DetachTool, 0);
+        if (KnobDetachSec > 0 && PIN_SpawnInternalThread(DetachTimer, 0, 0, 0) == INVALID_THREADID) {
+            cerr << "Cannot start the detach timer thread" << endl;
+            return 1;
+        }
 
         // Register function to be called when the application exits
         PIN_AddFiniFunction(Fini, 0);
@@ -254,8 +2665,8 @@ int main(int argc, char *argv[]) {
     cerr <<  "===============================================" << endl;
     cerr <<  "This application is instrumented by MyPinTool" << endl;
 
-    if (!KnobOutputFile.Value().empty()) {
-        cerr << "See file " << KnobOutputFile.Value() << " for analysis results" << endl;
+    if (!fileName.empty()) {
+        cerr << "See file " << fileName << " for analysis results" << endl;
     }
     cerr <<  "===============================================" << endl;
 
@@ -0,0 +1,268 @@
+/*! @file
+ *  Reuse distance and working set profiler. The reuse distance of an access
+ *  is the number of distinct lines touched since the previous access to the
+ *  same line, so an access hits in a fully associative LRU cache of C lines
+ *  exactly when its distance is below C. Distances are found in O(log n) with
+ *  a Fenwick tree over access times in which only the latest access of each
+ *  line is marked; the times are renumbered when the tree fills up. Distances
+ *  go into log2 histograms, globally and per instruction. The working set is
+ *  the number of distinct lines touched in each window of accesses.
+ */
+
+#ifndef REUSE_DISTANCE_H
+#define REUSE_DISTANCE_H
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <ostream>
+#include <algorithm>
+#include "addr_table.h"
+
+// counts of reuse distances in buckets [0], [1], [2, 4), [4, 8) .. lines, plus first accesses
+struct ReuseHistogram {
+    static const unsigned BUCKETS = 48;
+
+    uint64_t accesses;
+    uint64_t cold;
+    uint64_t buckets[BUCKETS];
+
+    ReuseHistogram() : accesses(0), cold(0) {
+        for (unsigned i = 0; i < BUCKETS; i++) {
+            buckets[i] = 0;
+        }
+    }
+
+    static unsigned bucketOf(uint64_t distance) {
+        unsigned bucket = 0;
+        while (distance > 0 && bucket < BUCKETS - 1) {
+            distance >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+
+    // the distances in `bucket` are below this many lines
+    static uint64_t bucketLimit(unsigned bucket) {
+        return (uint64_t)1 << bucket;
+    }
+
+    void add(uint64_t distance) {
+        accesses++;
+        buckets[bucketOf(distance)]++;
+    }
+
+    void addCold() {
+        accesses++;
+        cold++;
+    }
+};
+
+class ReuseProfiler {
+public:
+    static const uint64_t MIN_CAPACITY = 1 << 16;
+
+    ReuseProfiler(uint32_t lineSize, uint64_t window)
+        : m_lineBits(0), m_window(window), m_now(0),
+          m_windowIndex(0), m_windowAccesses(0), m_windowLines(0) {
+        while (((uint64_t)1 << m_lineBits) < lineSize) {
+            m_lineBits++;
+        }
+        m_tree.assign(MIN_CAPACITY + 1, 0);
+    }
+
+    uint32_t lineSize() const {
+        return 1 << m_lineBits;
+    }
+
+    // record that the instruction at `ip` accessed `size` bytes at `ea`, once per line touched
+    void access(uint64_t ip, uint64_t ea, uint32_t size) {
+        uint64_t last = ea + (size ? size : 1) - 1;
+        for (uint64_t line = ea >> m_lineBits; line <= last >> m_lineBits; line++) {
+            accessLine(ip, line);
+        }
+    }
+
+    // drop the histograms and working sets but remember each line's last access,
+    // so distances spanning the reset stay exact
+    void resetCounts() {
+        m_global = ReuseHistogram();
+        m_ins = AddrTable<ReuseHistogram>();
+        m_workingSets.clear();
+        m_windowAccesses = 0;
+        m_windowLines = 0;
+        m_windowIndex++;
+    }
+
+    // close the current working set window, so the last partial one is reported too
+    void finish() {
+        if (m_windowAccesses > 0) {
+            m_workingSets.push_back(m_windowLines);
+            m_windowAccesses = 0;
+            m_windowLines = 0;
+            m_windowIndex++;
+        }
+    }
+
+    // print the global histogram with the cumulative share of accesses that fit in each
+    // size, the working set of each window, then the histogram of every instruction;
+    // describe(ip) returns the text printed for an instruction
+    template <typename Describe>
+    void print(std::ostream& out, Describe describe) const {
+        out << "Reuse distance in " << lineSize() << " byte lines" << std::endl;
+        printHistogram(out, m_global);
+
+        out << "===============================================" << std::endl;
+        out << "Working set per " << m_window << " line accesses" << std::endl;
+        out << "===============================================" << std::endl;
+        uint64_t largest = 0;
+        for (size_t i = 0; i < m_workingSets.size(); i++) {
+            out << std::dec << i << " " << m_workingSets[i] << " lines "
+                << m_workingSets[i] * lineSize() << " bytes" << std::endl;
+            largest = std::max(largest, m_workingSets[i]);
+        }
+        out << "largest " << largest << " lines " << largest * lineSize() << " bytes" << std::endl;
+
+        out << "===============================================" << std::endl;
+        out << "Reuse distance of every instruction by address" << std::endl;
+        out << "===============================================" << std::endl;
+        std::vector<uint64_t> ips;
+        m_ins.sortedKeys(ips);
+        for (size_t i = 0; i < ips.size(); i++) {
+            const ReuseHistogram& histogram = *m_ins.find(ips[i]);
+            out << describe(ips[i]);
+            out << "        " << std::dec << histogram.accesses << " accesses, " << histogram.cold << " cold";
+            for (unsigned b = 0; b < ReuseHistogram::BUCKETS; b++) {
+                if (histogram.buckets[b] > 0) {
+                    out << ", <" << bytes(ReuseHistogram::bucketLimit(b)) << " " << histogram.buckets[b];
+                }
+            }
+            out << std::endl;
+        }
+    }
+
+private:
+    struct LineState {
+        uint64_t time;      // time of the latest access, marked in the tree
+        uint64_t window;    // last window the line was counted in, plus one, 0 if never accessed
+
+        LineState() : time(0), window(0) {}
+    };
+
+    void accessLine(uint64_t ip, uint64_t line) {
+        if (m_now == capacity()) {
+            compact();
+        }
+
+        LineState& state = m_lines[line];
+        ReuseHistogram& histogram = m_ins[ip];
+        if (state.window == 0) {
+            m_global.addCold();
+            histogram.addCold();
+        } else {
+            // marks after the previous access are the distinct lines touched since
+            uint64_t distance = prefix(m_now) - prefix(state.time + 1);
+            m_global.add(distance);
+            histogram.add(distance);
+            update(state.time, -1);
+        }
+
+        update(m_now, 1);
+        state.time = m_now++;
+
+        if (state.window != m_windowIndex + 1) {
+            state.window = m_windowIndex + 1;
+            m_windowLines++;
+        }
+        if (++m_windowAccesses == m_window) {
+            finish();
+        }
+    }
+
+    uint64_t capacity() const {
+        return m_tree.size() - 1;
+    }
+
+    // number of marks at times below `end`
+    uint64_t prefix(uint64_t end) const {
+        uint64_t sum = 0;
+        for (uint64_t i = end; i > 0; i -= i & (0 - i)) {
+            sum += m_tree[i];
+        }
+        return sum;
+    }
+
+    void update(uint64_t time, int32_t delta) {
+        for (uint64_t i = time + 1; i < m_tree.size(); i += i & (0 - i)) {
+            m_tree[i] += delta;
+        }
+    }
+
+    // renumber the marked times 0..k-1 in order and rebuild the tree with room to grow
+    void compact() {
+        std::vector<uint64_t> lines;
+        m_lines.sortedKeys(lines);
+
+        std::vector<std::pair<uint64_t, uint64_t> > byTime;
+        for (size_t i = 0; i < lines.size(); i++) {
+            byTime.push_back(std::make_pair(m_lines.find(lines[i])->time, lines[i]));
+        }
+        std::sort(byTime.begin(), byTime.end());
+
+        for (size_t i = 0; i < byTime.size(); i++) {
+            m_lines.find(byTime[i].second)->time = i;
+        }
+        m_now = byTime.size();
+
+        // every time below m_now is marked, so a node counts the part of its range below m_now
+        m_tree.assign(std::max((uint64_t)MIN_CAPACITY, 2 * m_now) + 1, 0);
+        for (uint64_t i = 1; i < m_tree.size(); i++) {
+            uint64_t first = i - (i & (0 - i));
+            m_tree[i] = m_now > first ? std::min(i & (0 - i), m_now - first) : 0;
+        }
+    }
+
+    std::string bytes(uint64_t lines) const {
+        static const char* units[] = { "B", "K", "M", "G", "T" };
+        uint64_t size = lines << m_lineBits;
+        unsigned unit = 0;
+        while (size >= 1024 && size % 1024 == 0 && unit < 4) {
+            size /= 1024;
+            unit++;
+        }
+        std::ostringstream sizeStream;
+        sizeStream << size << units[unit];
+        return sizeStream.str();
+    }
+
+    void printHistogram(std::ostream& out, const ReuseHistogram& histogram) const {
+        out << std::dec << histogram.accesses << " accesses, " << histogram.cold << " cold" << std::endl;
+
+        uint64_t cumulative = 0;
+        for (unsigned b = 0; b < ReuseHistogram::BUCKETS; b++) {
+            if (histogram.buckets[b] == 0) {
+                continue;
+            }
+            // accesses that hit in a fully associative LRU cache of this size
+            cumulative += histogram.buckets[b];
+            out << "<" << bytes(ReuseHistogram::bucketLimit(b)) << " " << histogram.buckets[b]
+                << " fit " << cumulative * 100.0 / histogram.accesses << "%" << std::endl;
+        }
+    }
+
+    unsigned m_lineBits;
+    uint64_t m_window;
+    uint64_t m_now;                     // time of the next access
+    std::vector<uint32_t> m_tree;       // Fenwick tree over times, 1-based
+    AddrTable<LineState> m_lines;       // keyed by line number
+    AddrTable<ReuseHistogram> m_ins;    // keyed by instruction address
+    ReuseHistogram m_global;
+
+    uint64_t m_windowIndex;
+    uint64_t m_windowAccesses;
+    uint64_t m_windowLines;
+    std::vector<uint64_t> m_workingSets;    // distinct lines of each finished window
+};
+
+#endif
@@ -0,0 +1,127 @@
+/*! @file
+ *  Shadow memory recording which addresses were accessed and with which size.
+ *  A page directory maps each touched page to a shadow page holding a bitmap
+ *  of accessed start addresses and a size tag per byte, so recording is O(1)
+ *  and memory grows with the pages touched rather than the addresses.
+ */
+
+#ifndef SHADOW_MEMORY_H
+#define SHADOW_MEMORY_H
+
+#include <stdint.h>
+#include <vector>
+#include "addr_table.h"
+
+class ShadowMemory {
+public:
+    static const unsigned PAGE_BITS = 12;
+    static const uint64_t PAGE_SIZE = 1 << PAGE_BITS;
+
+    ShadowMemory() : m_lastPageNumber(AddrTable<ShadowPage*>::EMPTY_KEY), m_lastPage(0) {}
+
+    ~ShadowMemory() {
+        for (size_t i = 0; i < m_pages.size(); i++) {
+            delete m_pages[i];
+        }
+    }
+
+    // remember that `size` bytes were accessed at `addr`, the last size wins
+    void record(uint64_t addr, uint32_t size) {
+        ShadowPage* page = pageOf(addr >> PAGE_BITS);
+        uint32_t offset = addr & (PAGE_SIZE - 1);
+
+        page->accessed[offset >> 6] |= (uint64_t)1 << (offset & 63);
+        page->sizes[offset] = size > 0xffff ? 0xffff : size;
+    }
+
+    // forget every access, as in a forked child
+    void clear() {
+        for (size_t i = 0; i < m_pages.size(); i++) {
+            delete m_pages[i];
+        }
+        m_pages.clear();
+        m_directory = AddrTable<ShadowPage*>();
+        m_lastPageNumber = AddrTable<ShadowPage*>::EMPTY_KEY;
+        m_lastPage = 0;
+    }
+
+    size_t pagesTouched() const {
+        return m_pages.size();
+    }
+
+    // call visit(addr, size) for every accessed address in ascending order
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        std::vector<uint64_t> pageNumbers;
+        m_directory.sortedKeys(pageNumbers);
+
+        for (size_t i = 0; i < pageNumbers.size(); i++) {
+            const ShadowPage* page = *m_directory.find(pageNumbers[i]);
+            uint64_t base = pageNumbers[i] << PAGE_BITS;
+
+            for (uint32_t word = 0; word < PAGE_SIZE / 64; word++) {
+                uint64_t bits = page->accessed[word];
+                while (bits) {
+                    uint32_t offset = word * 64 + __builtin_ctzll(bits);
+                    visit(base + offset, page->sizes[offset]);
+                    bits &= bits - 1;
+                }
+            }
+        }
+    }
+
+    // call visit(start, end) for every maximal range of bytes covered by the accesses
+    template <typename Visitor>
+    void forEachRange(Visitor visit) const {
+        bool open = false;
+        uint64_t start = 0;
+        uint64_t end = 0;
+
+        forEach([&](uint64_t addr, uint32_t size) {
+            if (open && addr <= end) {
+                end = addr + size > end ? addr + size : end;
+                return;
+            }
+            if (open) {
+                visit(start, end);
+            }
+            open = true;
+            start = addr;
+            end = addr + size;
+        });
+
+        if (open) {
+            visit(start, end);
+        }
+    }
+
+private:
+    struct ShadowPage {
+        uint64_t accessed[PAGE_SIZE / 64];  // bit per byte that started an access
+        uint16_t sizes[PAGE_SIZE];          // size of the last access starting there
+    };
+
+    ShadowPage* pageOf(uint64_t pageNumber) {
+        // consecutive accesses mostly stay in one page
+        if (pageNumber == m_lastPageNumber) {
+            return m_lastPage;
+        }
+
+        ShadowPage*& page = m_directory[pageNumber];
+        if (page == 0) {
+            page = new ShadowPage();
+            m_pages.push_back(page);
+        }
+
+        m_lastPageNumber = pageNumber;
+        m_lastPage = page;
+        return page;
+    }
+
+    AddrTable<ShadowPage*> m_directory;
+    std::vector<ShadowPage*> m_pages;
+    uint64_t m_lastPageNumber;
+    ShadowPage* m_lastPage;
+};
+
+#endif
@@ -0,0 +1,240 @@
+/*! @file
+ *  Byte-granular taint shadow of the application memory. A three-level page
+ *  directory maps each page holding tainted bytes to a bitmap with one bit per
+ *  byte, so a 4K page costs 512 bytes of shadow and untainted pages cost
+ *  nothing. Taint of up to 64 bytes is read and written as a mask, bit i
+ *  standing for byte i, which lets the propagation move taint byte by byte
+ *  between memory and registers.
+ *
+ *  All threads use it without a lock. Unused directory slots point to shared
+ *  empty nodes, so a lookup is three loads without a branch. New nodes are
+ *  published with a compare-and-swap, and bits change with atomic and/or.
+ *  Addresses are taken modulo 2^48, the x86-64 user address space.
+ */
+
+#ifndef TAINT_MEMORY_H
+#define TAINT_MEMORY_H
+
+#include <stdint.h>
+
+class TaintMemory {
+public:
+    static const unsigned PAGE_BITS = 12;
+    static const uint64_t PAGE_SIZE = 1 << PAGE_BITS;
+
+    TaintMemory() : m_tainted(0), m_emptyLeaf(&m_emptyPage), m_emptyMid(&m_emptyLeaf) {
+        for (unsigned i = 0; i < FANOUT; i++) {
+            m_root[i] = &m_emptyMid;
+        }
+    }
+
+    ~TaintMemory() {
+        for (unsigned i = 0; i < FANOUT; i++) {
+            if (m_root[i] == &m_emptyMid) {
+                continue;
+            }
+            for (unsigned j = 0; j < FANOUT; j++) {
+                TaintLeaf* leaf = m_root[i]->leaves[j];
+                if (leaf == &m_emptyLeaf) {
+                    continue;
+                }
+                for (unsigned k = 0; k < FANOUT; k++) {
+                    if (leaf->pages[k] != &m_emptyPage) {
+                        delete leaf->pages[k];
+                    }
+                }
+                delete leaf;
+            }
+            delete m_root[i];
+        }
+    }
+
+    // number of tainted bytes
+    uint64_t tainted() const {
+        return m_tainted;
+    }
+
+    // number of tainted bytes in the page holding `addr`, cheap enough for an inlined check
+    uint32_t pageTaint(uint64_t addr) const {
+        return findPage(addr >> PAGE_BITS)->count;
+    }
+
+    // taint `size` bytes at `addr`, any size
+    void set(uint64_t addr, uint64_t size) {
+        fill(addr, size, true);
+    }
+
+    // whether any of `size` bytes at `addr` is tainted
+    bool any(uint64_t addr, uint64_t size) const {
+        for (uint64_t i = 0; i < size; ) {
+            uint64_t offset = (addr + i) & (PAGE_SIZE - 1);
+            const TaintPage* page = findPage((addr + i) >> PAGE_BITS);
+            if (page->count == 0) {
+                // skip the rest of an untainted page
+                i += PAGE_SIZE - offset;
+                continue;
+            }
+            uint32_t n = chunk(addr + i, size - i);
+            if ((page->bits[offset >> 6] >> (offset & 63)) & lowBits(n)) {
+                return true;
+            }
+            i += n;
+        }
+        return false;
+    }
+
+    // taint of `size` bytes at `addr` as a mask, size at most 64
+    uint64_t mask(uint64_t addr, uint32_t size) const {
+        uint64_t bits = 0;
+        for (uint32_t i = 0; i < size; ) {
+            uint64_t offset = (addr + i) & (PAGE_SIZE - 1);
+            uint32_t n = chunk(addr + i, size - i);
+            uint64_t word = findPage((addr + i) >> PAGE_BITS)->bits[offset >> 6];
+            bits |= ((word >> (offset & 63)) & lowBits(n)) << i;
+            i += n;
+        }
+        return bits;
+    }
+
+    // set the taint of `size` bytes at `addr` from a mask, size at most 64
+    void assign(uint64_t addr, uint32_t size, uint64_t bits) {
+        for (uint32_t i = 0; i < size; ) {
+            uint32_t n = chunk(addr + i, size - i);
+            store(addr + i, n, bits >> i);
+            i += n;
+        }
+    }
+
+    // set the taint of every one of `size` bytes at `addr`, any size
+    void fill(uint64_t addr, uint64_t size, bool taint) {
+        for (uint64_t i = 0; i < size; ) {
+            uint32_t n = chunk(addr + i, size - i);
+            store(addr + i, n, taint ? ~(uint64_t)0 : 0);
+            i += n;
+        }
+    }
+
+private:
+    static const unsigned LEVEL_BITS = 12;
+    static const unsigned FANOUT = 1 << LEVEL_BITS;
+
+    struct TaintPage {
+        volatile uint64_t bits[PAGE_SIZE / 64];     // bit per tainted byte
+        volatile uint32_t count;                    // tainted bytes in the page
+
+        TaintPage() : count(0) {
+            for (unsigned i = 0; i < PAGE_SIZE / 64; i++) {
+                bits[i] = 0;
+            }
+        }
+    };
+
+    struct TaintLeaf {
+        TaintPage* volatile pages[FANOUT];
+
+        explicit TaintLeaf(TaintPage* empty) {
+            for (unsigned i = 0; i < FANOUT; i++) {
+                pages[i] = empty;
+            }
+        }
+    };
+
+    struct TaintMid {
+        TaintLeaf* volatile leaves[FANOUT];
+
+        explicit TaintMid(TaintLeaf* empty) {
+            for (unsigned i = 0; i < FANOUT; i++) {
+                leaves[i] = empty;
+            }
+        }
+    };
+
+    TaintMemory(const TaintMemory&);
+    TaintMemory& operator=(const TaintMemory&);
+
+    static uint64_t lowBits(uint32_t n) {
+        return n >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+    }
+
+    // bytes from `addr` up to `size` which share one bitmap word
+    static uint32_t chunk(uint64_t addr, uint64_t size) {
+        uint64_t left = 64 - (addr & 63);
+        return (uint32_t)(size < left ? size : left);
+    }
+
+    static unsigned rootIndex(uint64_t pageNumber) {
+        return (pageNumber >> (2 * LEVEL_BITS)) & (FANOUT - 1);
+    }
+
+    static unsigned midIndex(uint64_t pageNumber) {
+        return (pageNumber >> LEVEL_BITS) & (FANOUT - 1);
+    }
+
+    static unsigned leafIndex(uint64_t pageNumber) {
+        return pageNumber & (FANOUT - 1);
+    }
+
+    // the page holding `pageNumber`, the shared empty page if none of its bytes was ever tainted
+    TaintPage* findPage(uint64_t pageNumber) const {
+        return m_root[rootIndex(pageNumber)]->leaves[midIndex(pageNumber)]->pages[leafIndex(pageNumber)];
+    }
+
+    // put `fresh` into `slot` unless another thread got there first, and return the winner
+    template <typename T>
+    static T* publish(T* volatile& slot, T* empty, T* fresh) {
+        if (!__sync_bool_compare_and_swap(&slot, empty, fresh)) {
+            delete fresh;
+        }
+        return slot;
+    }
+
+    TaintPage* pageOf(uint64_t pageNumber) {
+        TaintMid* mid = m_root[rootIndex(pageNumber)];
+        if (mid == &m_emptyMid) {
+            mid = publish(m_root[rootIndex(pageNumber)], &m_emptyMid, new TaintMid(&m_emptyLeaf));
+        }
+        TaintLeaf* leaf = mid->leaves[midIndex(pageNumber)];
+        if (leaf == &m_emptyLeaf) {
+            leaf = publish(mid->leaves[midIndex(pageNumber)], &m_emptyLeaf, new TaintLeaf(&m_emptyPage));
+        }
+        TaintPage* page = leaf->pages[leafIndex(pageNumber)];
+        if (page == &m_emptyPage) {
+            page = publish(leaf->pages[leafIndex(pageNumber)], &m_emptyPage, new TaintPage());
+        }
+        return page;
+    }
+
+    // make the taint of `n` bytes at `addr`, all in one bitmap word, the low `n` bits of `bits`
+    void store(uint64_t addr, uint32_t n, uint64_t bits) {
+        uint64_t offset = addr & (PAGE_SIZE - 1);
+        uint64_t covered = lowBits(n) << (offset & 63);
+        uint64_t wanted = (bits << (offset & 63)) & covered;
+
+        TaintPage* page = findPage(addr >> PAGE_BITS);
+        if ((page->bits[offset >> 6] & covered) == wanted) {
+            return;
+        }
+        if (page == &m_emptyPage) {
+            page = pageOf(addr >> PAGE_BITS);
+        }
+
+        volatile uint64_t* word = &page->bits[offset >> 6];
+        uint64_t cleared = covered & ~wanted;
+        int64_t change = __builtin_popcountll(wanted & ~__sync_fetch_and_or(word, wanted));
+        if (cleared) {
+            change -= __builtin_popcountll(cleared & __sync_fetch_and_and(word, ~cleared));
+        }
+        if (change != 0) {
+            __sync_fetch_and_add(&page->count, (uint32_t)change);
+            __sync_fetch_and_add(&m_tainted, (uint64_t)change);
+        }
+    }
+
+    volatile uint64_t m_tainted;
+    TaintMid* volatile m_root[FANOUT];
+    TaintPage m_emptyPage;
+    TaintLeaf m_emptyLeaf;
+    TaintMid m_emptyMid;
+};
+
+#endif
@@ -0,0 +1,283 @@
+/*! @file
+ *  Compression of the record chunks of a binary trace, shared by project1
+ *  -compress and the offline decoder. A TRACE_CHUNK_ZREC chunk holds the same
+ *  records as a TRACE_CHUNK_REC chunk in two stages:
+ *
+ *    1. delta + varint: each field is stored as a LEB128 varint of its
+ *       zigzagged difference to a prediction. The order index and the
+ *       instruction are predicted by the previous record, the address of an
+ *       access by the last address accessed by the same instruction, so a
+ *       strided loop turns into the same few bytes per iteration.
+ *    2. LZ: repeated byte strings are replaced by back references into the
+ *       last 64K of the chunk, in the style of LZ4.
+ *
+ *  The payload is the varint stream size as a uint32 followed by the LZ
+ *  output. All prediction state starts afresh in every chunk, so each chunk
+ *  can be decoded on its own after seeking to it.
+ */
+
+#ifndef TRACE_CODEC_H
+#define TRACE_CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "trace_format.h"
+
+/* ===================================================================== */
+// Delta + varint stage
+/* ===================================================================== */
+
+inline void putVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+inline bool getVarint(const std::string& in, size_t& pos, uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; shift < 64 && pos < in.size(); shift += 7) {
+        uint8_t byte = in[pos++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// map signed differences to small unsigned numbers: 0, -1, 1, -2, ..
+inline uint64_t zigzag(uint64_t delta) {
+    return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+}
+
+inline uint64_t unzigzag(uint64_t value) {
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
+// predictions shared by the encoder and the decoder of one chunk
+class RecordPredictor {
+public:
+    static const unsigned TABLE_BITS = 10;
+
+    RecordPredictor() : seq(0), ip(0), m_lastEa(1 << TABLE_BITS, 0) {}
+
+    // last address accessed by the instruction, or one hashed to the same slot
+    uint64_t& lastEa(uint64_t insAddr) {
+        return m_lastEa[(insAddr * 0x9e3779b97f4a7c15ULL) >> (64 - TABLE_BITS)];
+    }
+
+    uint64_t seq;
+    uint64_t ip;
+
+private:
+    std::vector<uint64_t> m_lastEa;
+};
+
+inline void encodeRecords(const TraceRecord* records, uint32_t count, std::string& out) {
+    RecordPredictor predict;
+    for (uint32_t i = 0; i < count; i++) {
+        const TraceRecord& rec = records[i];
+        putVarint(out, zigzag(rec.seq - predict.seq));
+        putVarint(out, zigzag(rec.ip - predict.ip));
+        out += (char)rec.rw;
+        putVarint(out, rec.size);
+        if (isMemAccess(rec)) {
+            uint64_t& last = predict.lastEa(rec.ip);
+            putVarint(out, zigzag(rec.ea - last));
+            last = rec.ea;
+        } else {
+            putVarint(out, rec.ea);
+        }
+        predict.seq = rec.seq;
+        predict.ip = rec.ip;
+    }
+}
+
+inline bool decodeRecords(const std::string& in, uint32_t count, TraceRecord* records) {
+    RecordPredictor predict;
+    size_t pos = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        TraceRecord& rec = records[i];
+        uint64_t seq, ip, size, ea;
+        if (!getVarint(in, pos, seq) || !getVarint(in, pos, ip) || pos >= in.size()) {
+            return false;
+        }
+        rec.seq = predict.seq + unzigzag(seq);
+        rec.ip = predict.ip + unzigzag(ip);
+        rec.rw = (uint8_t)in[pos++];
+        if (!getVarint(in, pos, size) || !getVarint(in, pos, ea)) {
+            return false;
+        }
+        rec.size = size;
+        if (isMemAccess(rec)) {
+            uint64_t& last = predict.lastEa(rec.ip);
+            rec.ea = last + unzigzag(ea);
+            last = rec.ea;
+        } else {
+            rec.ea = ea;
+        }
+        predict.seq = rec.seq;
+        predict.ip = rec.ip;
+    }
+    return pos == in.size();
+}
+
+/* ===================================================================== */
+// LZ stage
+/* ===================================================================== */
+
+// Each sequence is a token (literal count << 4 | match length - 4), the
+// extra bytes of a count or length of 15 or more, the literals, then a
+// 16-bit offset back to the match. The last sequence has literals only.
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_MAX_OFFSET = 0xffff;
+const unsigned LZ_HASH_BITS = 14;
+
+inline uint32_t lzRead32(const std::string& in, size_t pos) {
+    uint32_t value;
+    memcpy(&value, in.data() + pos, sizeof(value));
+    return value;
+}
+
+inline void lzPutLength(std::string& out, size_t length) {
+    for (length -= 15; length >= 255; length -= 255) {
+        out += (char)255;
+    }
+    out += (char)length;
+}
+
+inline void lzPutSequence(std::string& out, const std::string& in, size_t literalsStart,
+                          size_t literals, size_t offset, size_t match) {
+    size_t matchCode = match ? match - LZ_MIN_MATCH : 0;
+    out += (char)(((literals < 15 ? literals : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+    if (literals >= 15) {
+        lzPutLength(out, literals);
+    }
+    out.append(in, literalsStart, literals);
+    if (match) {
+        out += (char)(offset & 0xff);
+        out += (char)(offset >> 8);
+        if (matchCode >= 15) {
+            lzPutLength(out, matchCode);
+        }
+    }
+}
+
+inline void lzCompress(const std::string& in, std::string& out) {
+    const uint32_t NONE = 0xffffffff;
+    std::vector<uint32_t> table(1 << LZ_HASH_BITS, NONE);
+    size_t anchor = 0;
+    size_t pos = 0;
+
+    while (pos + LZ_MIN_MATCH <= in.size()) {
+        uint32_t bytes = lzRead32(in, pos);
+        uint32_t& slot = table[(bytes * 2654435761u) >> (32 - LZ_HASH_BITS)];
+        size_t candidate = slot;
+        slot = pos;
+
+        if (candidate == NONE || pos - candidate > LZ_MAX_OFFSET || lzRead32(in, candidate) != bytes) {
+            pos++;
+            continue;
+        }
+
+        size_t match = LZ_MIN_MATCH;
+        while (pos + match < in.size() && in[candidate + match] == in[pos + match]) {
+            match++;
+        }
+        lzPutSequence(out, in, anchor, pos - anchor, pos - candidate, match);
+        pos += match;
+        anchor = pos;
+    }
+
+    lzPutSequence(out, in, anchor, in.size() - anchor, 0, 0);
+}
+
+inline bool lzGetLength(const std::string& in, size_t& pos, size_t& length) {
+    uint8_t byte;
+    do {
+        if (pos >= in.size()) {
+            return false;
+        }
+        byte = in[pos++];
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// decompress `in` into `out`, which must come out `size` bytes long
+inline bool lzDecompress(const std::string& in, size_t size, std::string& out) {
+    out.clear();
+    out.reserve(size);
+    size_t pos = 0;
+
+    while (pos < in.size()) {
+        uint8_t token = in[pos++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !lzGetLength(in, pos, literals)) {
+            return false;
+        }
+        if (literals > in.size() - pos) {
+            return false;
+        }
+        out.append(in, pos, literals);
+        pos += literals;
+
+        if (pos == in.size()) {
+            break;
+        }
+
+        if (pos + 2 > in.size()) {
+            return false;
+        }
+        size_t offset = (uint8_t)in[pos] | ((size_t)(uint8_t)in[pos + 1] << 8);
+        pos += 2;
+        size_t match = token & 15;
+        if (match == 15 && !lzGetLength(in, pos, match)) {
+            return false;
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out.size() || out.size() + match > size) {
+            return false;
+        }
+
+        // byte by byte, as a match may overlap the bytes it produces
+        size_t from = out.size() - offset;
+        for (size_t i = 0; i < match; i++) {
+            out += out[from + i];
+        }
+    }
+    return out.size() == size;
+}
+
+/* ===================================================================== */
+// Chunks
+/* ===================================================================== */
+
+// payload of a TRACE_CHUNK_ZREC chunk holding `count` records
+inline std::string compressRecords(const TraceRecord* records, uint32_t count) {
+    std::string varints;
+    encodeRecords(records, count, varints);
+
+    uint32_t rawSize = varints.size();
+    std::string payload((const char*)&rawSize, sizeof(rawSize));
+    lzCompress(varints, payload);
+    return payload;
+}
+
+inline bool decompressRecords(const std::string& payload, uint32_t count, TraceRecord* records) {
+    uint32_t rawSize;
+    if (payload.size() < sizeof(rawSize)) {
+        return false;
+    }
+    memcpy(&rawSize, payload.data(), sizeof(rawSize));
+
+    std::string varints;
+    return lzDecompress(payload.substr(sizeof(rawSize)), rawSize, varints) &&
+        decodeRecords(varints, count, records);
+}
+
+#endif
@@ -0,0 +1,367 @@
+/*! @file
+ *  Execution-order view of the records of one thread: the dynamic control
+ *  flow rebuilt from the order indexes and the call, return and branch flags
+ *  of the instructions, without looking at the instruction text.
+ *
+ *  The records are sorted by order index once; everything else is a single
+ *  pass over them. An execution is a run of records of one instruction. A
+ *  block ends after a call, return or branch, or where the next instruction
+ *  executed is not the next one in address order. A call pushes a frame
+ *  unless the return site runs next, which means the callee was not traced.
+ *  A taken branch to an address at or below itself is a back edge: the first
+ *  one starts a loop, later ones to the same head count its iterations, and
+ *  the loop ends when its frame runs code outside [head, latch].
+ *
+ *  The view has three parts. The block sequence shows each block with its
+ *  instruction count, indented by call depth; a loop prints its first
+ *  iteration and then a line with its iteration count. The call tree merges
+ *  calls by calling context, with total and self instruction and memory
+ *  access counts. The loop list gives each loop head the number of times the
+ *  loop ran and its iterations. Sampled or burst traces have holes in the
+ *  flow, so the view only makes sense for full traces.
+ */
+
+#ifndef TRACE_FLOW_H
+#define TRACE_FLOW_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <ostream>
+#include <algorithm>
+#include "trace_format.h"
+
+// the traced instructions in address order, with their TraceInsFlags
+class FlowTable {
+public:
+    // add the instructions in ascending address order
+    void add(uint64_t addr, uint32_t flags) {
+        m_addrs.push_back(addr);
+        m_flags.push_back(flags);
+    }
+
+    uint32_t flags(uint64_t ip) const {
+        std::vector<uint64_t>::const_iterator it = std::lower_bound(m_addrs.begin(), m_addrs.end(), ip);
+        return it != m_addrs.end() && *it == ip ? m_flags[it - m_addrs.begin()] : 0;
+    }
+
+    // the instruction after ip in address order, 0 if there is none
+    uint64_t next(uint64_t ip) const {
+        std::vector<uint64_t>::const_iterator it = std::upper_bound(m_addrs.begin(), m_addrs.end(), ip);
+        return it != m_addrs.end() ? *it : 0;
+    }
+
+private:
+    std::vector<uint64_t> m_addrs;
+    std::vector<uint32_t> m_flags;
+};
+
+inline bool traceRecordBySeq(const TraceRecord& a, const TraceRecord& b) {
+    return a.seq < b.seq;
+}
+
+class ThreadFlow {
+public:
+    static const uint64_t UNTRACED = 0;
+
+    ThreadFlow(const FlowTable& table, std::ostream& out)
+        : m_table(table), m_out(out), m_quiet(0), m_prevIp(0), m_prevFlags(0), m_started(false),
+          m_blockStart(0), m_blockLast(0), m_blockIns(0), m_blockShown(false) {}
+
+    // walk the records of the thread, sorting them by order index first
+    void run(std::vector<TraceRecord>& records) {
+        std::sort(records.begin(), records.end(), traceRecordBySeq);
+
+        uint64_t ip = 0;
+        uint32_t kinds = 0;
+        for (size_t i = 0; i < records.size(); i++) {
+            const TraceRecord& rec = records[i];
+            if (isValueRecord(rec) || isHeapEvent(rec) || rec.rw == TRACE_BURST) {
+                continue;
+            }
+
+            // one execution per instruction, unless an access kind repeats as in a REP loop
+            uint32_t kind = 1 << (rec.rw == TRACE_READ ? 0 : rec.rw == TRACE_WRITE ? 1 : 2);
+            if (!m_started || rec.ip != ip || (kinds & kind) || (m_prevFlags & (TRACE_INS_BRANCH | TRACE_INS_CALL | TRACE_INS_RET))) {
+                execute(rec.ip);
+                ip = rec.ip;
+                kinds = 0;
+            }
+            kinds |= kind;
+            if (isMemAccess(rec)) {
+                m_nodes[m_frames.back().node].selfAccesses++;
+            }
+        }
+        finish();
+    }
+
+    // print the call tree and the loops; describe(ip) returns the text printed for a call target
+    template <typename Describe>
+    void printSummary(Describe describe) const {
+        if (m_nodes.empty()) {
+            return;
+        }
+
+        m_out << "===============================================" << std::endl;
+        m_out << "Calls by context: calls, instructions (self), accesses (self)" << std::endl;
+        m_out << "===============================================" << std::endl;
+        printNode(0, 0, describe);
+
+        m_out << "===============================================" << std::endl;
+        m_out << "Loops by head: runs, iterations, most iterations in a run" << std::endl;
+        m_out << "===============================================" << std::endl;
+        for (std::map<uint64_t, LoopStats>::const_iterator it = m_loopStats.begin(); it != m_loopStats.end(); ++it) {
+            m_out << std::hex << it->first << "-" << it->second.latch << std::dec << "  "
+                  << it->second.runs << " runs, " << it->second.iterations << " iterations, max "
+                  << it->second.maxIterations << std::endl;
+        }
+    }
+
+private:
+    // a calling context, merged over all calls from the same context
+    struct CallNode {
+        uint64_t entry;
+        uint64_t calls;
+        uint64_t selfInstructions;
+        uint64_t selfAccesses;
+        uint64_t instructions;      // including the callees, set by finish()
+        uint64_t accesses;
+        std::map<uint64_t, size_t> children;    // node index by entry address
+
+        CallNode(uint64_t entry) : entry(entry), calls(0), selfInstructions(0), selfAccesses(0),
+                                   instructions(0), accesses(0) {}
+    };
+
+    struct ActiveLoop {
+        uint64_t head;
+        uint64_t latch;
+        uint64_t iterations;
+    };
+
+    struct Frame {
+        size_t node;
+        std::vector<ActiveLoop> loops;
+    };
+
+    struct LoopStats {
+        uint64_t latch;
+        uint64_t runs;
+        uint64_t iterations;
+        uint64_t maxIterations;
+
+        LoopStats() : latch(0), runs(0), iterations(0), maxIterations(0) {}
+    };
+
+    void execute(uint64_t ip) {
+        uint32_t flags = m_table.flags(ip);
+
+        if (!m_started) {
+            m_nodes.push_back(CallNode(ip));
+            m_nodes[0].calls = 1;
+            pushFrame(0);
+            m_started = true;
+            startBlock(ip);
+        } else {
+            bool sequential = !(m_prevFlags & (TRACE_INS_BRANCH | TRACE_INS_CALL | TRACE_INS_RET)) &&
+                ip == m_table.next(m_prevIp);
+            if (!sequential) {
+                endBlock();
+            }
+
+            if (m_prevFlags & TRACE_INS_CALL) {
+                if (ip == m_table.next(m_prevIp)) {
+                    // the callee ran untraced and returned
+                    child(UNTRACED).calls++;
+                } else {
+                    if (m_quiet == 0) {
+                        line() << "call " << std::hex << ip << std::dec << std::endl;
+                    }
+                    CallNode& callee = child(ip);
+                    callee.calls++;
+                    pushFrame(&callee - &m_nodes[0]);
+                }
+            } else if ((m_prevFlags & TRACE_INS_RET) && m_frames.size() > 1) {
+                popFrame();
+            }
+
+            leaveLoops(ip);
+            if ((m_prevFlags & TRACE_INS_BRANCH) && ip <= m_prevIp) {
+                backEdge(ip, m_prevIp);
+            }
+
+            if (!sequential) {
+                startBlock(ip);
+            }
+        }
+
+        m_nodes[m_frames.back().node].selfInstructions++;
+        m_blockIns++;
+        m_blockLast = ip;
+        m_prevIp = ip;
+        m_prevFlags = flags;
+    }
+
+    void finish() {
+        if (!m_started) {
+            return;
+        }
+        endBlock();
+        while (!m_frames.empty()) {
+            popFrame();
+        }
+        total(0);
+    }
+
+    CallNode& child(uint64_t entry) {
+        size_t parent = m_frames.back().node;
+        std::map<uint64_t, size_t>::iterator it = m_nodes[parent].children.find(entry);
+        if (it != m_nodes[parent].children.end()) {
+            return m_nodes[it->second];
+        }
+        m_nodes.push_back(CallNode(entry));
+        m_nodes[parent].children[entry] = m_nodes.size() - 1;
+        return m_nodes.back();
+    }
+
+    void pushFrame(size_t node) {
+        Frame frame;
+        frame.node = node;
+        m_frames.push_back(frame);
+    }
+
+    void popFrame() {
+        while (!m_frames.back().loops.empty()) {
+            popLoop();
+        }
+        m_frames.pop_back();
+    }
+
+    // end the loops of the current frame whose range ip is outside of, innermost first
+    void leaveLoops(uint64_t ip) {
+        std::vector<ActiveLoop>& loops = m_frames.back().loops;
+        while (!loops.empty() && (ip < loops.back().head || ip > loops.back().latch)) {
+            popLoop();
+        }
+    }
+
+    void backEdge(uint64_t head, uint64_t latch) {
+        std::vector<ActiveLoop>& loops = m_frames.back().loops;
+        if (!loops.empty() && loops.back().head == head) {
+            loops.back().latch = std::max(loops.back().latch, latch);
+            loops.back().iterations++;
+            return;
+        }
+
+        // the first iteration has run, the second starts here and is no longer printed
+        ActiveLoop loop = { head, latch, 2 };
+        loops.push_back(loop);
+        m_quiet++;
+    }
+
+    void popLoop() {
+        ActiveLoop loop = m_frames.back().loops.back();
+        m_frames.back().loops.pop_back();
+
+        LoopStats& stats = m_loopStats[loop.head];
+        stats.latch = std::max(stats.latch, loop.latch);
+        stats.runs++;
+        stats.iterations += loop.iterations;
+        stats.maxIterations = std::max(stats.maxIterations, loop.iterations);
+
+        // loops end where a block ends, so the count follows the blocks of the first iteration
+        if (--m_quiet == 0) {
+            line() << "loop " << std::hex << loop.head << "-" << loop.latch << std::dec
+                   << " x " << loop.iterations << " iterations" << std::endl;
+        }
+    }
+
+    void startBlock(uint64_t ip) {
+        m_blockStart = ip;
+        m_blockLast = ip;
+        m_blockIns = 0;
+        m_blockShown = m_quiet == 0;
+    }
+
+    void endBlock() {
+        if (m_blockShown && m_blockIns > 0) {
+            line() << std::hex << m_blockStart << "-" << m_blockLast << std::dec
+                   << "  " << m_blockIns << " ins" << std::endl;
+        }
+        m_blockIns = 0;
+        m_blockShown = false;
+    }
+
+    // start a line of the block sequence, indented by call depth
+    std::ostream& line() {
+        m_out << std::string(2 * (m_frames.size() - 1), ' ');
+        return m_out;
+    }
+
+    void total(size_t index) {
+        CallNode& node = m_nodes[index];
+        node.instructions = node.selfInstructions;
+        node.accesses = node.selfAccesses;
+        for (std::map<uint64_t, size_t>::iterator it = node.children.begin(); it != node.children.end(); ++it) {
+            total(it->second);
+            node.instructions += m_nodes[it->second].instructions;
+            node.accesses += m_nodes[it->second].accesses;
+        }
+    }
+
+    template <typename Describe>
+    void printNode(size_t index, unsigned depth, Describe describe) const {
+        const CallNode& node = m_nodes[index];
+        m_out << std::string(2 * depth, ' ');
+        if (index == 0) {
+            m_out << "start ";
+        }
+        m_out << (node.entry == UNTRACED ? std::string("untraced") : describe(node.entry)) << "  " << std::dec
+              << node.calls << " calls, " << node.instructions << " ins (" << node.selfInstructions << "), "
+              << node.accesses << " accesses (" << node.selfAccesses << ")" << std::endl;
+
+        // heaviest callees first
+        std::vector<std::pair<uint64_t, size_t> > children;
+        for (std::map<uint64_t, size_t>::const_iterator it = node.children.begin(); it != node.children.end(); ++it) {
+            children.push_back(std::make_pair(~m_nodes[it->second].instructions, it->second));
+        }
+        std::sort(children.begin(), children.end());
+        for (size_t i = 0; i < children.size(); i++) {
+            printNode(children[i].second, depth + 1, describe);
+        }
+    }
+
+    const FlowTable& m_table;
+    std::ostream& m_out;
+    std::vector<CallNode> m_nodes;          // [0] is where the thread's records start
+    std::vector<Frame> m_frames;
+    std::map<uint64_t, LoopStats> m_loopStats;
+    unsigned m_quiet;                       // active loops past their first iteration
+
+    uint64_t m_prevIp;
+    uint32_t m_prevFlags;
+    bool m_started;
+
+    uint64_t m_blockStart;
+    uint64_t m_blockLast;
+    uint64_t m_blockIns;
+    bool m_blockShown;
+};
+
+// print the execution-order view of every thread; `threads` holds the records of each
+// thread, sorted here, and describe(ip) returns the text printed for a call target
+template <typename Describe>
+void printFlowView(std::ostream& out, std::map<uint32_t, std::vector<TraceRecord> >& threads,
+                   const FlowTable& table, Describe describe) {
+    for (std::map<uint32_t, std::vector<TraceRecord> >::iterator it = threads.begin(); it != threads.end(); ++it) {
+        out << "===============================================" << std::endl;
+        out << "Control flow of thread " << std::dec << it->first << std::endl;
+        out << "===============================================" << std::endl;
+
+        ThreadFlow flow(table, out);
+        flow.run(it->second);
+        flow.printSummary(describe);
+    }
+}
+
+#endif
@@ -0,0 +1,210 @@
+/*! @file
+ *  Layout of the binary trace written by project1 with -binary, shared with
+ *  the offline decoder. Kept free of Pin types so both sides agree on it.
+ *
+ *  A trace file is a TraceFileHeader followed by a sequence of chunks. Each
+ *  chunk is a TraceChunkHeader followed by `bytes` bytes of payload:
+ *
+ *    TRACE_CHUNK_INS  `count` TraceInsEntry, each followed by its text
+ *    TRACE_CHUNK_REC  `count` TraceRecord executed by thread `tid`
+ *    TRACE_CHUNK_SAMPLING  one TraceSampling, if the run was sampled
+ *    TRACE_CHUNK_ZREC  `count` TraceRecord of thread `tid`, compressed (see trace_codec.h)
+ *
+ *  With value capture, a value record follows the access it belongs to and
+ *  carries the same seq. Its `ea` holds the value; for TRACE_MEM_VALUE `size`
+ *  is the number of bytes captured, for TRACE_REG_VALUE it is the position of
+ *  the register among the instruction's written registers.
+ *
+ *  In burst mode a TRACE_BURST record marks where a thread starts (`size` 1)
+ *  or stops (`size` 0) tracing; its `ea` is the number of traced-code
+ *  instructions the thread had executed at that point, bursts included.
+ *
+ *  With heap tracking, TRACE_ALLOC and TRACE_FREE records mark calls of the
+ *  allocator: `ip` is the call site, `ea` the start of the allocation and
+ *  `size` its size (saturated at 4G), or 0 for a free.
+ */
+
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+#include <stdint.h>
+#include <string>
+#include <sstream>
+
+#define TRACE_MAGIC   0x43525450    // "PTRC"
+#define TRACE_VERSION 1
+
+struct TraceFileHeader {
+    uint32_t magic;
+    uint32_t version;
+};
+
+enum TraceChunkType {
+    TRACE_CHUNK_INS = 1,
+    TRACE_CHUNK_REC = 2,
+    TRACE_CHUNK_SAMPLING = 3,
+    TRACE_CHUNK_ZREC = 4
+};
+
+struct TraceChunkHeader {
+    uint32_t type;
+    uint32_t tid;
+    uint32_t count;
+    uint32_t bytes;
+};
+
+// kind of access stored in TraceRecord::rw
+enum TraceAccess {
+    TRACE_NO_MEM = 0,
+    TRACE_READ = 'r',
+    TRACE_WRITE = 'w',
+    TRACE_MEM_VALUE = 'v',
+    TRACE_REG_VALUE = 'g',
+    TRACE_BURST = 'b',
+    TRACE_ALLOC = 'a',
+    TRACE_FREE = 'f'
+};
+
+// one execution of an instruction, with its memory access if any
+struct TraceRecord {
+    uint64_t seq;
+    uint64_t ip;
+    uint64_t ea;
+    uint32_t size;
+    uint32_t rw;
+};
+
+// static description of an instruction, `textLen` bytes of text follow it
+struct TraceInsEntry {
+    uint64_t addr;
+    uint32_t flags;
+    uint32_t textLen;
+};
+
+// how the records were sampled, so counts can be scaled back up.
+// With `period` > 1 one in `period` executions of each instruction is recorded;
+// with `burstOn` > 0 threads alternate `burstOn` traced and `burstOff` skipped instructions.
+struct TraceSampling {
+    uint32_t period;
+    uint32_t burstOn;
+    uint32_t burstOff;
+    uint32_t reserved;
+};
+
+// bits of TraceInsEntry::flags
+enum TraceInsFlags {
+    TRACE_INS_CALL = 1,
+    TRACE_INS_RET = 2,
+    TRACE_INS_BRANCH = 4
+};
+
+inline bool isMemAccess(const TraceRecord& rec) {
+    return rec.rw == TRACE_READ || rec.rw == TRACE_WRITE;
+}
+
+inline bool isValueRecord(const TraceRecord& rec) {
+    return rec.rw == TRACE_MEM_VALUE || rec.rw == TRACE_REG_VALUE;
+}
+
+// return the written register at `index` from an instruction log "addr NAME -r-> .. -w-> .."
+inline std::string writtenRegName(const std::string& insText, uint32_t index) {
+    size_t written = insText.find("-w->");
+    if (written == std::string::npos) {
+        return "?";
+    }
+
+    std::istringstream tokens(insText.substr(written + 4));
+    std::string token;
+    uint32_t position = 0;
+    while (tokens >> token) {
+        if (token != "(float)" && position++ == index) {
+            return token;
+        }
+    }
+    return "?";
+}
+
+// return the string format of the log of a memory access
+inline std::string getMemLog(const TraceRecord& rec) {
+    std::ostringstream detailStream;
+    detailStream << "        [" << rec.seq << "] ";
+    if (rec.rw != TRACE_NO_MEM) {
+        detailStream << " -" << (char)rec.rw << "-> " << std::hex << rec.ea << " <" << rec.size << ">" << std::endl;
+    } else {
+        detailStream << " no mem access" << std::endl;
+    }
+    return detailStream.str();
+}
+
+// return the string format of a captured value, printed under its access
+inline std::string getValueLog(const TraceRecord& rec, const std::string& insText) {
+    std::ostringstream detailStream;
+    detailStream << "            => ";
+    if (rec.rw == TRACE_REG_VALUE) {
+        detailStream << writtenRegName(insText, rec.size) << " ";
+    }
+    detailStream << std::hex << rec.ea << std::endl;
+    return detailStream.str();
+}
+
+// return the string format of a burst boundary, printed under the block it starts or ends at
+inline std::string getBurstLog(const TraceRecord& rec) {
+    std::ostringstream detailStream;
+    detailStream << "        [" << rec.seq << "]  burst " << (rec.size ? "start" : "end")
+                 << " after " << std::dec << rec.ea << " instructions" << std::endl;
+    return detailStream.str();
+}
+
+inline bool isHeapEvent(const TraceRecord& rec) {
+    return rec.rw == TRACE_ALLOC || rec.rw == TRACE_FREE;
+}
+
+// return the string format of an allocation or free, printed under its call site
+inline std::string getHeapLog(const TraceRecord& rec) {
+    std::ostringstream detailStream;
+    detailStream << "        [" << rec.seq << "]  ";
+    if (rec.rw == TRACE_ALLOC) {
+        detailStream << "alloc " << std::hex << rec.ea << " <" << std::dec << rec.size << ">" << std::endl;
+    } else {
+        detailStream << "free " << std::hex << rec.ea << std::endl;
+    }
+    return detailStream.str();
+}
+
+inline std::string getRecordLog(const TraceRecord& rec, const std::string& insText) {
+    if (rec.rw == TRACE_BURST) {
+        return getBurstLog(rec);
+    }
+    if (isHeapEvent(rec)) {
+        return getHeapLog(rec);
+    }
+    return isValueRecord(rec) ? getValueLog(rec, insText) : getMemLog(rec);
+}
+
+// header line of a sampled trace, telling how to scale its counts
+inline std::string getSamplingLog(const TraceSampling& sampling) {
+    std::ostringstream detailStream;
+    if (sampling.period > 1) {
+        detailStream << "Sampled 1 in " << sampling.period << " executions of each instruction, "
+                     << "multiply counts by " << sampling.period << std::endl;
+    }
+    if (sampling.burstOn > 0) {
+        detailStream << "Traced in bursts of " << sampling.burstOn << " instructions every "
+                     << sampling.burstOn + sampling.burstOff << ", multiply counts by "
+                     << (double)(sampling.burstOn + sampling.burstOff) / sampling.burstOn << std::endl;
+    }
+    return detailStream.str();
+}
+
+// order records by instruction, then by execution order, values after their access
+inline bool traceRecordByIp(const TraceRecord& a, const TraceRecord& b) {
+    if (a.ip != b.ip) {
+        return a.ip < b.ip;
+    }
+    if (a.seq != b.seq) {
+        return a.seq < b.seq;
+    }
+    return !isValueRecord(a) && isValueRecord(b);
+}
+
+#endif
@@ -0,0 +1,220 @@
+/*! @file
+ *  Index of a binary trace, written next to it as "<trace>.idx" by tracequery.
+ *  For every record chunk it keeps where the chunk is, its range of order
+ *  indexes (seq), its range of accessed addresses, and the sorted lists of
+ *  the pages it accesses and the instructions it executes. A query only reads
+ *  the chunks whose lists and ranges can match, instead of the whole trace.
+ *
+ *  An index file is a TraceIndexHeader followed by one TraceIndexChunk per
+ *  record chunk, each followed by `pageCount` page numbers and `insCount`
+ *  instruction addresses, all uint64_t and ascending. The header stamps the
+ *  trace it was made for with its size, its modification time and a hash of
+ *  its first bytes, which hold the trace header and the first chunk. An index
+ *  of a trace that has grown since, e.g. one still being streamed, or has been
+ *  rewritten by another run, is rebuilt.
+ */
+
+#ifndef TRACE_INDEX_H
+#define TRACE_INDEX_H
+
+#include <stdint.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <sys/stat.h>
+#include "trace_reader.h"
+
+#define TRACE_INDEX_MAGIC   0x49525450    // "PTRI"
+#define TRACE_INDEX_VERSION 2
+
+// pages of 4K, the granularity at which the index knows the accessed memory
+const unsigned TRACE_INDEX_PAGE_BITS = 12;
+
+// bytes at the start of the trace covered by the hash in its stamp
+const uint64_t TRACE_INDEX_HASHED_BYTES = 64 * 1024;
+
+// identifies the trace an index was made for
+struct TraceIndexStamp {
+    uint64_t traceSize;
+    uint64_t traceMtime;        // seconds since the epoch
+    uint64_t traceHash;         // FNV-1a of the first TRACE_INDEX_HASHED_BYTES
+
+    bool operator==(const TraceIndexStamp& other) const {
+        return traceSize == other.traceSize && traceMtime == other.traceMtime && traceHash == other.traceHash;
+    }
+};
+
+struct TraceIndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    TraceIndexStamp stamp;
+    uint32_t chunks;
+    uint32_t reserved;
+};
+
+struct TraceIndexChunk {
+    uint64_t offset;            // of the chunk payload in the trace
+    TraceChunkHeader header;
+    uint64_t minSeq;
+    uint64_t maxSeq;
+    uint64_t minEa;             // of the memory accesses, minEa > maxEa if there are none
+    uint64_t maxEa;
+    uint32_t pageCount;
+    uint32_t insCount;
+};
+
+// a chunk of the index with its page and instruction lists
+struct TraceIndexEntry {
+    TraceIndexChunk chunk;
+    std::vector<uint64_t> pages;
+    std::vector<uint64_t> ips;
+
+    TraceChunkInfo info() const {
+        TraceChunkInfo info;
+        info.offset = chunk.offset;
+        info.header = chunk.header;
+        return info;
+    }
+
+    bool overlapsSeq(uint64_t from, uint64_t to) const {
+        return chunk.header.count > 0 && chunk.minSeq <= to && from <= chunk.maxSeq;
+    }
+
+    // whether an access of the chunk may touch [low, high)
+    bool mayTouch(uint64_t low, uint64_t high) const {
+        if (chunk.minEa > chunk.maxEa || high <= chunk.minEa || low > chunk.maxEa) {
+            return false;
+        }
+        std::vector<uint64_t>::const_iterator page =
+            std::lower_bound(pages.begin(), pages.end(), low >> TRACE_INDEX_PAGE_BITS);
+        return page != pages.end() && *page <= (high - 1) >> TRACE_INDEX_PAGE_BITS;
+    }
+
+    bool executes(uint64_t ip) const {
+        return std::binary_search(ips.begin(), ips.end(), ip);
+    }
+};
+
+// sorted distinct values
+inline void sortUnique(std::vector<uint64_t>& values) {
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+}
+
+// stamp the trace at `path` as indexed at `traceSize` bytes, false if it cannot be read.
+// A trace still growing then gets a size below the current one and is indexed again.
+inline bool stampTrace(const std::string& path, uint64_t traceSize, TraceIndexStamp& stamp) {
+    struct stat info;
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    if (stat(path.c_str(), &info) != 0 || !in) {
+        return false;
+    }
+    stamp.traceSize = traceSize;
+    stamp.traceMtime = info.st_mtime;
+
+    std::vector<char> bytes(std::min<uint64_t>(stamp.traceSize, TRACE_INDEX_HASHED_BYTES));
+    if (!bytes.empty() && !in.read(&bytes[0], bytes.size())) {
+        return false;
+    }
+    stamp.traceHash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < bytes.size(); i++) {
+        stamp.traceHash = (stamp.traceHash ^ (unsigned char)bytes[i]) * 0x100000001b3ULL;
+    }
+    return true;
+}
+
+// index every record chunk of an open trace
+inline bool buildTraceIndex(TraceReader& reader, std::vector<TraceIndexEntry>& index) {
+    const std::vector<TraceChunkInfo>& chunks = reader.chunks();
+    index.resize(chunks.size());
+
+    std::vector<TraceRecord> records;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        records.clear();
+        if (!reader.readRecords(chunks[i], records)) {
+            return false;
+        }
+
+        TraceIndexEntry& entry = index[i];
+        entry.chunk.offset = chunks[i].offset;
+        entry.chunk.header = chunks[i].header;
+        entry.chunk.minSeq = ~(uint64_t)0;
+        entry.chunk.maxSeq = 0;
+        entry.chunk.minEa = ~(uint64_t)0;
+        entry.chunk.maxEa = 0;
+        entry.pages.clear();
+        entry.ips.clear();
+
+        for (size_t r = 0; r < records.size(); r++) {
+            const TraceRecord& rec = records[r];
+            entry.chunk.minSeq = std::min(entry.chunk.minSeq, rec.seq);
+            entry.chunk.maxSeq = std::max(entry.chunk.maxSeq, rec.seq);
+            entry.ips.push_back(rec.ip);
+            if (!isMemAccess(rec)) {
+                continue;
+            }
+
+            uint64_t last = rec.ea + (rec.size ? rec.size : 1) - 1;
+            entry.chunk.minEa = std::min(entry.chunk.minEa, rec.ea);
+            entry.chunk.maxEa = std::max(entry.chunk.maxEa, last);
+            for (uint64_t page = rec.ea >> TRACE_INDEX_PAGE_BITS; page <= last >> TRACE_INDEX_PAGE_BITS; page++) {
+                entry.pages.push_back(page);
+            }
+        }
+
+        sortUnique(entry.pages);
+        sortUnique(entry.ips);
+        entry.chunk.pageCount = entry.pages.size();
+        entry.chunk.insCount = entry.ips.size();
+    }
+    return true;
+}
+
+inline bool writeTraceIndex(const std::string& path, const TraceIndexStamp& stamp, const std::vector<TraceIndexEntry>& index) {
+    std::ofstream out(path.c_str(), std::ios::out | std::ios::binary);
+    TraceIndexHeader header = { TRACE_INDEX_MAGIC, TRACE_INDEX_VERSION, stamp, (uint32_t)index.size(), 0 };
+    out.write((const char*)&header, sizeof(header));
+
+    for (size_t i = 0; i < index.size(); i++) {
+        const TraceIndexEntry& entry = index[i];
+        out.write((const char*)&entry.chunk, sizeof(entry.chunk));
+        if (!entry.pages.empty()) {
+            out.write((const char*)&entry.pages[0], entry.pages.size() * sizeof(uint64_t));
+        }
+        if (!entry.ips.empty()) {
+            out.write((const char*)&entry.ips[0], entry.ips.size() * sizeof(uint64_t));
+        }
+    }
+    return (bool)out;
+}
+
+// read an index, false if it is missing, bad or made for a trace with another stamp
+inline bool readTraceIndex(const std::string& path, const TraceIndexStamp& stamp, std::vector<TraceIndexEntry>& index) {
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    TraceIndexHeader header;
+    if (!in.read((char*)&header, sizeof(header)) || header.magic != TRACE_INDEX_MAGIC ||
+            header.version != TRACE_INDEX_VERSION || !(header.stamp == stamp)) {
+        return false;
+    }
+
+    index.resize(header.chunks);
+    for (size_t i = 0; i < index.size(); i++) {
+        TraceIndexEntry& entry = index[i];
+        if (!in.read((char*)&entry.chunk, sizeof(entry.chunk))) {
+            return false;
+        }
+        entry.pages.resize(entry.chunk.pageCount);
+        entry.ips.resize(entry.chunk.insCount);
+        if (!entry.pages.empty()) {
+            in.read((char*)&entry.pages[0], entry.pages.size() * sizeof(uint64_t));
+        }
+        if (!entry.ips.empty()) {
+            in.read((char*)&entry.ips[0], entry.ips.size() * sizeof(uint64_t));
+        }
+    }
+    return (bool)in;
+}
+
+#endif
@@ -0,0 +1,200 @@
+/*! @file
+ *  Reader of the binary trace shared by the offline tools. Opening a trace
+ *  walks its chunk headers once, loading the instruction table and the
+ *  sampling chunk and remembering where every record chunk starts, so the
+ *  records themselves are only read chunk by chunk when asked for. Also
+ *  holds the text view the tool prints without -binary, so the tools can
+ *  regenerate it for a whole trace or for any slice of it.
+ */
+
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+
+#include <stdint.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "trace_format.h"
+#include "trace_codec.h"
+
+// a REC or ZREC chunk, found where its payload starts
+struct TraceChunkInfo {
+    uint64_t offset;
+    TraceChunkHeader header;
+};
+
+class TraceReader {
+public:
+    TraceReader() : m_size(0) {
+        m_sampling.period = 0;
+        m_sampling.burstOn = 0;
+        m_sampling.burstOff = 0;
+        m_sampling.reserved = 0;
+    }
+
+    // read the header and walk the chunks, false with a message on cerr if the trace is bad
+    bool open(const std::string& path) {
+        m_in.open(path.c_str(), std::ios::in | std::ios::binary);
+        if (!m_in) {
+            std::cerr << "cannot open " << path << std::endl;
+            return false;
+        }
+
+        TraceFileHeader header;
+        if (!m_in.read((char*)&header, sizeof(header)) || header.magic != TRACE_MAGIC) {
+            std::cerr << "not a trace file" << std::endl;
+            return false;
+        }
+        if (header.version != TRACE_VERSION) {
+            std::cerr << "unsupported trace version " << header.version << std::endl;
+            return false;
+        }
+
+        TraceChunkHeader chunk;
+        while (m_in.read((char*)&chunk, sizeof(chunk))) {
+            if (chunk.type == TRACE_CHUNK_INS) {
+                for (uint32_t i = 0; i < chunk.count; i++) {
+                    TraceInsEntry entry;
+                    m_in.read((char*)&entry, sizeof(entry));
+                    std::string text(entry.textLen, '\0');
+                    m_in.read(&text[0], entry.textLen);
+                    m_insLogs[entry.addr] = text;
+                    m_insFlags[entry.addr] = entry.flags;
+                }
+            } else if (chunk.type == TRACE_CHUNK_REC || chunk.type == TRACE_CHUNK_ZREC) {
+                TraceChunkInfo info;
+                info.offset = m_in.tellg();
+                info.header = chunk;
+                m_chunks.push_back(info);
+                m_in.seekg(chunk.bytes, std::ios::cur);
+            } else if (chunk.type == TRACE_CHUNK_SAMPLING && chunk.bytes == sizeof(m_sampling)) {
+                m_in.read((char*)&m_sampling, sizeof(m_sampling));
+            } else {
+                // unknown chunk, skip its payload
+                m_in.seekg(chunk.bytes, std::ios::cur);
+            }
+
+            if (!m_in) {
+                std::cerr << "truncated trace file" << std::endl;
+                return false;
+            }
+        }
+
+        m_in.clear();
+        m_in.seekg(0, std::ios::end);
+        m_size = m_in.tellg();
+        return true;
+    }
+
+    // append the records of a chunk to `records`
+    bool readRecords(const TraceChunkInfo& info, std::vector<TraceRecord>& records) {
+        const TraceChunkHeader& chunk = info.header;
+        size_t first = records.size();
+        records.resize(first + chunk.count);
+        m_in.clear();
+        m_in.seekg(info.offset);
+
+        if (chunk.type == TRACE_CHUNK_REC) {
+            m_in.read((char*)&records[first], chunk.count * sizeof(TraceRecord));
+        } else {
+            std::string payload(chunk.bytes, '\0');
+            m_in.read(&payload[0], chunk.bytes);
+            if (m_in && !decompressRecords(payload, chunk.count, &records[first])) {
+                std::cerr << "corrupt compressed chunk" << std::endl;
+                return false;
+            }
+        }
+
+        if (!m_in) {
+            std::cerr << "truncated trace file" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // append every record of the trace
+    bool readAllRecords(std::vector<TraceRecord>& records) {
+        for (size_t i = 0; i < m_chunks.size(); i++) {
+            if (!readRecords(m_chunks[i], records)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const std::map<uint64_t, std::string>& insLogs() const {
+        return m_insLogs;
+    }
+
+    // TraceInsFlags of each instruction, keyed by address
+    const std::map<uint64_t, uint32_t>& insFlags() const {
+        return m_insFlags;
+    }
+
+    const TraceSampling& sampling() const {
+        return m_sampling;
+    }
+
+    // the record chunks in file order
+    const std::vector<TraceChunkInfo>& chunks() const {
+        return m_chunks;
+    }
+
+    uint64_t size() const {
+        return m_size;
+    }
+
+private:
+    std::ifstream m_in;
+    uint64_t m_size;
+    std::map<uint64_t, std::string> m_insLogs;     // static log of each instruction, keyed by address
+    std::map<uint64_t, uint32_t> m_insFlags;
+    std::vector<TraceChunkInfo> m_chunks;
+    TraceSampling m_sampling;                       // all zero for a full trace
+};
+
+// print records the way the tool does without -binary: instructions ordered by
+// address with their executions, then all memory addresses accessed
+inline void printTextView(std::ostream& out, const std::map<uint64_t, std::string>& insLogs,
+                          std::vector<TraceRecord>& records, const TraceSampling& sampling) {
+    // the last size each address was accessed with, in execution order
+    std::map<uint64_t, std::pair<uint64_t, uint32_t> > memSet;
+    for (size_t i = 0; i < records.size(); i++) {
+        const TraceRecord& rec = records[i];
+        if (!isMemAccess(rec)) {
+            continue;
+        }
+        std::pair<uint64_t, uint32_t>& last = memSet[rec.ea];
+        if (last.second == 0 || rec.seq >= last.first) {
+            last = std::make_pair(rec.seq, rec.size);
+        }
+    }
+
+    out << getSamplingLog(sampling);
+
+    std::sort(records.begin(), records.end(), traceRecordByIp);
+
+    size_t rec = 0;
+    for (std::map<uint64_t, std::string>::const_iterator it = insLogs.begin(); it != insLogs.end(); ++it) {
+        out << it->second;
+
+        for (; rec < records.size() && records[rec].ip <= it->first; rec++) {
+            if (records[rec].ip == it->first) {
+                out << getRecordLog(records[rec], it->second);
+            }
+        }
+    }
+
+    out << "===============================================" << std::endl;
+    out << "All memeory address accessed by the instructions" << std::endl;
+    out << "===============================================" << std::endl;
+
+    for (std::map<uint64_t, std::pair<uint64_t, uint32_t> >::iterator it = memSet.begin(); it != memSet.end(); ++it) {
+        out << std::hex << it->first << " " << it->second.second << std::endl;
+    }
+}
+
+#endif
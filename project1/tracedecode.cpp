@@ -0,0 +1,78 @@
+/*! @file
+ *  Offline decoder for the binary trace written by project1 -binary.
+ *  It prints the same text layout the tool prints without -binary:
+ *  instructions ordered by address with their executions, followed by
+ *  all memory addresses accessed. With -flow it prints the execution-order
+ *  view of each thread instead, see trace_flow.h.
+ *
+ *  usage: tracedecode [-flow] <trace file> [output file]
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <cstring>
+#include "trace_reader.h"
+#include "trace_flow.h"
+
+using namespace std;
+
+// call targets are only known by address in a trace
+string describeAddr(uint64_t ip) {
+    ostringstream ipStream;
+    ipStream << hex << ip;
+    return ipStream.str();
+}
+
+bool printFlow(TraceReader& reader, ostream& out) {
+    FlowTable table;
+    const map<uint64_t, uint32_t>& flags = reader.insFlags();
+    for (map<uint64_t, uint32_t>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        table.add(it->first, it->second);
+    }
+
+    map<uint32_t, vector<TraceRecord> > threads;
+    for (size_t i = 0; i < reader.chunks().size(); i++) {
+        const TraceChunkInfo& chunk = reader.chunks()[i];
+        if (!reader.readRecords(chunk, threads[chunk.header.tid])) {
+            return false;
+        }
+    }
+
+    out << getSamplingLog(reader.sampling());
+    printFlowView(out, threads, table, describeAddr);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    bool flow = argc > 1 && strcmp(argv[1], "-flow") == 0;
+    int arg = flow ? 2 : 1;
+    if (argc <= arg) {
+        cerr << "usage: " << argv[0] << " [-flow] <trace file> [output file]" << endl;
+        return 1;
+    }
+
+    TraceReader reader;
+    if (!reader.open(argv[arg])) {
+        return 1;
+    }
+
+    ofstream outFile;
+    if (argc > arg + 1) {
+        outFile.open(argv[arg + 1]);
+    }
+    ostream& out = argc > arg + 1 ? outFile : cout;
+
+    if (flow) {
+        return printFlow(reader, out) ? 0 : 1;
+    }
+
+    vector<TraceRecord> traceRecords;
+    if (!reader.readAllRecords(traceRecords)) {
+        return 1;
+    }
+    printTextView(out, reader.insLogs(), traceRecords, reader.sampling());
+    return 0;
+}
@@ -0,0 +1,290 @@
+/*! @file
+ *  Offline query tool for the binary trace written by project1 -binary or
+ *  -stream. The first query builds an index of the trace (see trace_index.h)
+ *  and saves it as "<trace>.idx"; later queries only read the chunks the
+ *  index says can match. Matching executions are listed in execution order,
+ *  as the instructions that made them, or in the text view of the tool.
+ *
+ *  usage: tracequery <trace file> [filters] [-who | -text] [-o file] [-reindex]
+ *    -ins addr      executions of the instruction at hex addr
+ *    -mem lo:hi     memory accesses touching the hex range [lo, hi)
+ *    -seq from:to   executions with order index from to to, inclusive
+ *    -r, -w         only reads, only writes
+ *    -who           list the instructions of the matches, with their counts
+ *    -text          print the matches in the text view of the tool
+ *
+ *  e.g. all writes to a stack range between seq 1000 and 2000:
+ *    tracequery trace.bin -mem 7ffee1e37000:7ffee1e38000 -seq 1000:2000 -w
+ *  every instruction that touched an address:
+ *    tracequery trace.bin -mem 7ffee1e374f8:7ffee1e374f9 -who
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include "trace_reader.h"
+#include "trace_index.h"
+
+using namespace std;
+
+struct Query {
+    bool byIns;
+    uint64_t ip;
+    bool byMem;
+    uint64_t low;
+    uint64_t high;
+    uint64_t fromSeq;
+    uint64_t toSeq;
+    uint32_t rw;            // TRACE_READ or TRACE_WRITE, 0 for both
+};
+
+// a matching record and the thread that executed it
+struct Match {
+    TraceRecord rec;
+    uint32_t tid;
+};
+
+// execution order, values after their access
+bool matchBySeq(const Match& a, const Match& b) {
+    if (a.rec.seq != b.rec.seq) {
+        return a.rec.seq < b.rec.seq;
+    }
+    return !isValueRecord(a.rec) && isValueRecord(b.rec);
+}
+
+bool parseHex(const string& text, uint64_t& value) {
+    istringstream valueStream(text);
+    return (bool)(valueStream >> hex >> value);
+}
+
+// parse "first:second", hex or decimal
+bool parsePair(const string& text, bool isHex, uint64_t& first, uint64_t& second) {
+    size_t colon = text.find(':');
+    if (colon == string::npos) {
+        return false;
+    }
+    istringstream firstStream(text.substr(0, colon));
+    istringstream secondStream(text.substr(colon + 1));
+    if (isHex) {
+        firstStream >> hex;
+        secondStream >> hex;
+    }
+    return (firstStream >> first) && (secondStream >> second) && first <= second;
+}
+
+// whether a record that is not a value matches the query
+bool matches(const Query& query, const TraceRecord& rec) {
+    if (rec.seq < query.fromSeq || rec.seq > query.toSeq) {
+        return false;
+    }
+    if (query.byIns && rec.ip != query.ip) {
+        return false;
+    }
+    if (query.rw && rec.rw != query.rw) {
+        return false;
+    }
+    if (query.byMem) {
+        uint64_t end = rec.ea + (rec.size ? rec.size : 1);
+        return isMemAccess(rec) && rec.ea < query.high && query.low < end;
+    }
+    return true;
+}
+
+// the index of the trace, loaded if it is up to date, otherwise built and saved
+bool loadIndex(TraceReader& reader, const string& path, bool reindex, vector<TraceIndexEntry>& index) {
+    string indexPath = path + ".idx";
+    TraceIndexStamp stamp;
+    if (!stampTrace(path, reader.size(), stamp)) {
+        cerr << "cannot read " << path << endl;
+        return false;
+    }
+    if (!reindex && readTraceIndex(indexPath, stamp, index)) {
+        return true;
+    }
+
+    cerr << "indexing " << path << endl;
+    if (!buildTraceIndex(reader, index)) {
+        return false;
+    }
+    if (!writeTraceIndex(indexPath, stamp, index)) {
+        cerr << "cannot write " << indexPath << ", the index is not kept" << endl;
+    }
+    return true;
+}
+
+// read the chunks which can match and collect the matching records
+bool runQuery(TraceReader& reader, const vector<TraceIndexEntry>& index, const Query& query, vector<Match>& found) {
+    size_t read = 0;
+    vector<TraceRecord> records;
+
+    for (size_t i = 0; i < index.size(); i++) {
+        const TraceIndexEntry& entry = index[i];
+        if (!entry.overlapsSeq(query.fromSeq, query.toSeq) ||
+                (query.byIns && !entry.executes(query.ip)) ||
+                (query.byMem && !entry.mayTouch(query.low, query.high))) {
+            continue;
+        }
+
+        records.clear();
+        if (!reader.readRecords(entry.info(), records)) {
+            return false;
+        }
+        read++;
+
+        // a value record follows the access it belongs to and goes with it
+        bool lastMatched = false;
+        for (size_t r = 0; r < records.size(); r++) {
+            const TraceRecord& rec = records[r];
+            if (!isValueRecord(rec)) {
+                lastMatched = matches(query, rec);
+            }
+            if (lastMatched) {
+                Match match = { rec, entry.chunk.header.tid };
+                found.push_back(match);
+            }
+        }
+    }
+
+    cerr << "read " << read << " of " << index.size() << " chunks, "
+         << found.size() << " records match" << endl;
+    sort(found.begin(), found.end(), matchBySeq);
+    return true;
+}
+
+string insText(const map<uint64_t, string>& insLogs, uint64_t ip) {
+    map<uint64_t, string>::const_iterator it = insLogs.find(ip);
+    if (it != insLogs.end()) {
+        return it->second;
+    }
+    ostringstream ipStream;
+    ipStream << hex << ip << endl;
+    return ipStream.str();
+}
+
+// each match under its instruction, in execution order
+void printMatches(ostream& out, const map<uint64_t, string>& insLogs, const vector<Match>& found) {
+    for (size_t i = 0; i < found.size(); i++) {
+        const TraceRecord& rec = found[i].rec;
+        string text = insText(insLogs, rec.ip);
+        if (!isValueRecord(rec)) {
+            out << "t" << dec << found[i].tid << " " << text;
+        }
+        out << getRecordLog(rec, text);
+    }
+}
+
+// reads, writes and executions without a memory access of one instruction
+struct WhoCount {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t noMem;
+
+    WhoCount() : reads(0), writes(0), noMem(0) {}
+};
+
+// the instructions of the matches, by address, with their reads, writes and
+// executions without a memory access. Burst, alloc and free records are not counted.
+void printWho(ostream& out, const map<uint64_t, string>& insLogs, const vector<Match>& found) {
+    map<uint64_t, WhoCount> counts;
+    for (size_t i = 0; i < found.size(); i++) {
+        const TraceRecord& rec = found[i].rec;
+        if (rec.rw == TRACE_READ) {
+            counts[rec.ip].reads++;
+        } else if (rec.rw == TRACE_WRITE) {
+            counts[rec.ip].writes++;
+        } else if (rec.rw == TRACE_NO_MEM) {
+            counts[rec.ip].noMem++;
+        }
+    }
+
+    for (map<uint64_t, WhoCount>::iterator it = counts.begin(); it != counts.end(); ++it) {
+        out << dec << it->second.reads << " reads, " << it->second.writes << " writes, "
+            << it->second.noMem << " without memory  " << insText(insLogs, it->first);
+    }
+}
+
+// the text view of the tool, restricted to the instructions of the matches
+void printSlice(ostream& out, const TraceReader& reader, const vector<Match>& found) {
+    vector<TraceRecord> records;
+    map<uint64_t, string> sliceIns;
+    for (size_t i = 0; i < found.size(); i++) {
+        records.push_back(found[i].rec);
+        sliceIns[found[i].rec.ip] = insText(reader.insLogs(), found[i].rec.ip);
+    }
+    printTextView(out, sliceIns, records, reader.sampling());
+}
+
+int usage(const char* name) {
+    cerr << "usage: " << name << " <trace file> [-ins addr] [-mem lo:hi] [-seq from:to] [-r | -w]" << endl
+         << "       [-who | -text] [-o file] [-reindex]" << endl;
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        return usage(argv[0]);
+    }
+
+    Query query = { false, 0, false, 0, 0, 0, ~(uint64_t)0, 0 };
+    bool who = false;
+    bool text = false;
+    bool reindex = false;
+    string outFile;
+
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-ins" && hasValue && parseHex(argv[i + 1], query.ip)) {
+            query.byIns = true;
+            i++;
+        } else if (arg == "-mem" && hasValue && parsePair(argv[i + 1], true, query.low, query.high) &&
+                query.low < query.high) {
+            query.byMem = true;
+            i++;
+        } else if (arg == "-seq" && hasValue && parsePair(argv[i + 1], false, query.fromSeq, query.toSeq)) {
+            i++;
+        } else if (arg == "-r") {
+            query.rw = TRACE_READ;
+        } else if (arg == "-w") {
+            query.rw = TRACE_WRITE;
+        } else if (arg == "-who") {
+            who = true;
+        } else if (arg == "-text") {
+            text = true;
+        } else if (arg == "-reindex") {
+            reindex = true;
+        } else if (arg == "-o" && hasValue) {
+            outFile = argv[++i];
+        } else {
+            cerr << "invalid argument " << arg << endl;
+            return usage(argv[0]);
+        }
+    }
+
+    TraceReader reader;
+    vector<TraceIndexEntry> index;
+    vector<Match> found;
+    if (!reader.open(argv[1]) || !loadIndex(reader, argv[1], reindex, index) ||
+            !runQuery(reader, index, query, found)) {
+        return 1;
+    }
+
+    ofstream outFileStream;
+    if (!outFile.empty()) {
+        outFileStream.open(outFile.c_str());
+    }
+    ostream& out = outFile.empty() ? cout : outFileStream;
+
+    if (who) {
+        printWho(out, reader.insLogs(), found);
+    } else if (text) {
+        printSlice(out, reader, found);
+    } else {
+        printMatches(out, reader.insLogs(), found);
+    }
+    return 0;
+}
@@ -13,23 +13,726 @@
 //===----------------------------------------------------------------------===//
 
 #define DEBUG_TYPE "hello"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/Pass.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/InstIterator.h"
 #include "llvm/Support/CallSite.h"
+#include "llvm/Support/CFG.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include <string>
 #include <set>
 #include <map>
 #include <fstream>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
 
 using namespace std;
 using namespace llvm;
 
+static cl::opt<unsigned> MaxPrintedPaths("project2-max-paths", cl::init(64),
+  cl::desc("Print every path of a function when it has at most this many paths"));
+
+static cl::list<string> PrintedFunctions("project2-function", cl::CommaSeparated,
+  cl::desc("Functions whose paths are printed, main by default"));
+
+static cl::list<unsigned long long> PrintedPathIds("project2-path",
+  cl::CommaSeparated, cl::desc("Print the paths of the printed functions with these ids"));
+
+static cl::opt<string> ProfileFile("project2-profile",
+  cl::desc("Path profile written by a program built with -Project2Profile"));
+
+static cl::opt<unsigned> HotPaths("project2-hot-paths", cl::init(5),
+  cl::desc("Number of hot paths to print and mark in the graph"));
+
+static cl::opt<unsigned> Threads("project2-threads", cl::init(0),
+  cl::desc("Threads analyzing functions, one per core by default"));
+
+static cl::opt<bool> UsePointsTo("project2-points-to",
+  cl::desc("Resolve indirect calls with points-to analysis instead of types"));
+
+static cl::opt<unsigned long long> MaxProfiledPaths("project2-profile-max-paths",
+  cl::init(1 << 16), cl::desc("Don't profile functions with more paths than this"));
 
 namespace {
+  // Ball-Larus path numbering of one function. A DFS from the entry finds the
+  // back edges; every back edge v -> w is cut into a path ending at v and a
+  // path starting at w, which leaves an acyclic graph. One pass in reverse
+  // topological order counts the paths from each block to an end and gives
+  // every edge a value, so that the sum of the values along a path is a
+  // unique id in [0, getNumPaths()). getPath() rebuilds a path from its id.
+  class PathNumbering {
+  public:
+    struct Edge {
+      BasicBlock* from;
+      BasicBlock* to;     // for a back edge, the loop head it returns to
+      bool back;          // the path ends here and restarts at "to"
+      uint64_t value;
+    };
+
+    PathNumbering(Function &F) : overflow(false) {
+      BasicBlock* entry = entryBlock = &F.getEntryBlock();
+
+      // iterative DFS, a successor still on the stack closes a loop
+      DenseMap<BasicBlock*, int> state;
+      DenseSet<pair<BasicBlock*, BasicBlock*> > backEdges;
+      vector<pair<BasicBlock*, unsigned> > stack;
+
+      state[entry] = 1;
+      stack.push_back(make_pair(entry, 0u));
+
+      while (!stack.empty()) {
+        BasicBlock* bb = stack.back().first;
+        TerminatorInst* termIns = bb->getTerminator();
+
+        if (stack.back().second < termIns->getNumSuccessors()) {
+          BasicBlock* successor = termIns->getSuccessor(stack.back().second++);
+          int &s = state[successor];
+
+          if (s == 0) {
+            s = 1;
+            stack.push_back(make_pair(successor, 0u));
+          } else if (s == 1) {
+            backEdges.insert(make_pair(bb, successor));
+
+            if (heads.insert(successor)) {
+              loopHeads.push_back(successor);
+            }
+          }
+        } else {
+          state[bb] = 2;
+          blocks.push_back(bb);
+          stack.pop_back();
+        }
+      }
+
+      // post order visits every successor on a forward edge first
+      for (unsigned i = 0; i < blocks.size(); i++) {
+        BasicBlock* bb = blocks[i];
+        TerminatorInst* termIns = bb->getTerminator();
+        vector<Edge> &out = edges[bb];
+        SmallPtrSet<BasicBlock*, 8> seen;
+        uint64_t n = 0;
+
+        for (unsigned idx = 0; idx < termIns->getNumSuccessors(); idx++) {
+          BasicBlock* successor = termIns->getSuccessor(idx);
+
+          // a switch may name the same block twice, one edge is enough
+          if (!seen.insert(successor)) {
+            continue;
+          }
+
+          Edge e;
+          e.from = bb;
+          e.to = successor;
+          e.back = backEdges.count(make_pair(bb, successor));
+          e.value = n;
+          out.push_back(e);
+
+          n = add(n, e.back ? 1 : numPaths[successor]);
+        }
+
+        numPaths[bb] = out.empty() ? 1 : n;
+      }
+
+      // ids of paths from the entry come first, then one range per loop head
+      total = numPaths[entry];
+
+      for (unsigned i = 0; i < loopHeads.size(); i++) {
+        headValues.push_back(total);
+        total = add(total, numPaths[loopHeads[i]]);
+      }
+    }
+
+    // number of paths, or UINT64_MAX when there are too many to number
+    uint64_t getNumPaths() const {
+      return total;
+    }
+
+    bool overflowed() const {
+      return overflow;
+    }
+
+    BasicBlock* getEntry() const {
+      return entryBlock;
+    }
+
+    // blocks reachable from the entry, every block after its successors
+    // on forward edges
+    const vector<BasicBlock*>& getBlocks() const {
+      return blocks;
+    }
+
+    uint64_t getNumPaths(BasicBlock* bb) const {
+      DenseMap<BasicBlock*, uint64_t>::const_iterator it = numPaths.find(bb);
+      return it == numPaths.end() ? 0 : it->second;
+    }
+
+    // outgoing edges of a reachable block, in successor order
+    const vector<Edge>& getEdges(BasicBlock* bb) const {
+      return edges.find(bb)->second;
+    }
+
+    const vector<BasicBlock*>& getLoopHeads() const {
+      return loopHeads;
+    }
+
+    // value a path starting at the given loop head begins with
+    uint64_t getHeadValue(unsigned i) const {
+      return headValues[i];
+    }
+
+    // blocks of path "id" in order, returns the back edge that ends the
+    // path or NULL when it ends in a block without successors
+    const Edge* getPath(uint64_t id, vector<BasicBlock*> &path) const {
+      BasicBlock* bb = entryBlock;
+      unsigned head = loopHeads.size();
+
+      while (head > 0 && headValues[head - 1] > id) {
+        head--;
+      }
+
+      if (head > 0) {
+        bb = loopHeads[head - 1];
+        id -= headValues[head - 1];
+      }
+
+      while (true) {
+        path.push_back(bb);
+
+        const vector<Edge> &out = getEdges(bb);
+
+        if (out.empty()) {
+          return NULL;
+        }
+
+        unsigned idx = out.size() - 1;
+
+        while (out[idx].value > id) {
+          idx--;
+        }
+
+        id -= out[idx].value;
+
+        if (out[idx].back) {
+          return &out[idx];
+        }
+
+        bb = out[idx].to;
+      }
+    }
+
+  private:
+    uint64_t add(uint64_t a, uint64_t b) {
+      if (a > UINT64_MAX - b) {
+        overflow = true;
+        return UINT64_MAX;
+      }
+
+      return a + b;
+    }
+
+    BasicBlock* entryBlock;
+    vector<BasicBlock*> blocks;
+    DenseMap<BasicBlock*, vector<Edge> > edges;
+    DenseMap<BasicBlock*, uint64_t> numPaths;
+    SmallPtrSet<BasicBlock*, 8> heads;
+    vector<BasicBlock*> loopHeads;
+    vector<uint64_t> headValues;
+    uint64_t total;
+    bool overflow;
+  };
+
+  // Path register increments for profiling one numbered function. The
+  // numbered graph is closed into a cycle through a virtual node X with the
+  // edges X -> entry, X -> each loop head, and v -> X from each block without
+  // successors and each back edge source. Edges of a maximum spanning tree
+  // need no code. Every other edge adds val + pot(from) - pot(to) to the
+  // path register, the potentials are chosen so that the increments along a
+  // path from X back to X sum up to the path id.
+  class PathIncrements {
+  public:
+    typedef pair<BasicBlock*, BasicBlock*> BlockPair;
+
+    PathIncrements(const PathNumbering &paths) {
+      const vector<BasicBlock*> &blocks = paths.getBlocks();
+      const vector<BasicBlock*> &loopHeads = paths.getLoopHeads();
+      DenseMap<BasicBlock*, unsigned> node;
+
+      // node 0 is X
+      for (unsigned i = 0; i < blocks.size(); i++) {
+        node[blocks[i]] = i + 1;
+      }
+
+      vector<TreeEdge> graph;
+      addEdge(graph, 0, node[paths.getEntry()], 0, 0, BlockPair(NULL, paths.getEntry()));
+
+      for (unsigned i = 0; i < loopHeads.size(); i++) {
+        addEdge(graph, 0, node[loopHeads[i]], paths.getHeadValue(i), 0, BlockPair(NULL, loopHeads[i]));
+      }
+
+      for (unsigned i = 0; i < blocks.size(); i++) {
+        BasicBlock* bb = blocks[i];
+        const vector<PathNumbering::Edge> &out = paths.getEdges(bb);
+
+        if (out.empty()) {
+          addEdge(graph, node[bb], 0, 0, 0, BlockPair(bb, NULL));
+        }
+
+        for (unsigned j = 0; j < out.size(); j++) {
+          const PathNumbering::Edge &e = out[j];
+
+          if (e.back) {
+            addEdge(graph, node[bb], 0, e.value, 0, BlockPair(bb, e.to));
+          } else {
+            // code on an edge that has to be split costs the most
+            int weight = needsSplit(bb, e.to) ? 2 : 1;
+            addEdge(graph, node[bb], node[e.to], e.value, weight, BlockPair(bb, e.to));
+          }
+        }
+      }
+
+      // maximum spanning tree by Kruskal, the edges to and from X cost
+      // nothing to instrument so they are taken last
+      vector<unsigned> parent(blocks.size() + 1);
+      vector<vector<unsigned> > tree(blocks.size() + 1);
+
+      for (unsigned i = 0; i < parent.size(); i++) {
+        parent[i] = i;
+      }
+
+      for (int weight = 2; weight >= 0; weight--) {
+        for (unsigned i = 0; i < graph.size(); i++) {
+          TreeEdge &e = graph[i];
+
+          if (e.weight != weight) {
+            continue;
+          }
+
+          unsigned a = find(parent, e.from), b = find(parent, e.to);
+
+          if (a != b) {
+            parent[a] = b;
+            e.inTree = true;
+            tree[e.from].push_back(i);
+            tree[e.to].push_back(i);
+          }
+        }
+      }
+
+      // potentials from X along the tree, arithmetic wraps modulo 2^64
+      vector<uint64_t> pot(blocks.size() + 1, 0);
+      vector<bool> done(blocks.size() + 1, false);
+      vector<unsigned> work(1, 0);
+      done[0] = true;
+
+      while (!work.empty()) {
+        unsigned n = work.back();
+        work.pop_back();
+
+        for (unsigned i = 0; i < tree[n].size(); i++) {
+          const TreeEdge &e = graph[tree[n][i]];
+
+          if (e.from == n && !done[e.to]) {
+            pot[e.to] = pot[n] + e.value;
+            done[e.to] = true;
+            work.push_back(e.to);
+          } else if (e.to == n && !done[e.from]) {
+            pot[e.from] = pot[n] - e.value;
+            done[e.from] = true;
+            work.push_back(e.from);
+          }
+        }
+      }
+
+      entry = 0;
+
+      for (unsigned i = 0; i < graph.size(); i++) {
+        const TreeEdge &e = graph[i];
+        uint64_t inc = e.inTree ? 0 : e.value + pot[e.from] - pot[e.to];
+
+        if (e.from == 0 && e.blocks.second == paths.getEntry()) {
+          entry = inc;
+        } else if (e.from == 0) {
+          heads[e.blocks.second] = inc;
+        } else if (e.to == 0) {
+          exits[e.blocks] = inc;
+        } else if (inc != 0) {
+          edges[e.blocks] = inc;
+        }
+      }
+    }
+
+    // edge bb -> successor can't take code in bb or successor alone
+    static bool needsSplit(BasicBlock* bb, BasicBlock* successor) {
+      return bb->getTerminator()->getNumSuccessors() > 1 && successor->getUniquePredecessor() != bb;
+    }
+
+    uint64_t entry;                            // register value at the entry
+    DenseMap<BlockPair, uint64_t> edges;       // nonzero increments of forward edges
+    DenseMap<BlockPair, uint64_t> exits;       // count register + inc when a path ends,
+                                               // (bb, NULL) for a block without successors
+    DenseMap<BasicBlock*, uint64_t> heads;     // register value after a back edge
+
+  private:
+    struct TreeEdge {
+      unsigned from, to;
+      uint64_t value;
+      int weight;
+      bool inTree;
+      BlockPair blocks;
+    };
+
+    static void addEdge(vector<TreeEdge> &graph, unsigned from, unsigned to, uint64_t value,
+                        int weight, BlockPair blocks) {
+      TreeEdge e;
+      e.from = from;
+      e.to = to;
+      e.value = value;
+      e.weight = weight;
+      e.inTree = false;
+      e.blocks = blocks;
+      graph.push_back(e);
+    }
+
+    static unsigned find(vector<unsigned> &parent, unsigned n) {
+      while (parent[n] != n) {
+        parent[n] = parent[parent[n]];
+        n = parent[n];
+      }
+
+      return n;
+    }
+  };
+
+  // executed paths of one function in a path profile
+  struct FunctionProfile {
+    uint64_t numPaths;
+    vector<pair<uint64_t, uint64_t> > counts;    // path id, count
+  };
+
+  // reads a profile written by profile_rt.c, see there for the format
+  bool readProfile(const string &file, map<string, FunctionProfile> &profile) {
+    ifstream in(file.c_str(), ios::binary);
+    char magic[4];
+    uint32_t version, count;
+
+    if (!in.read(magic, 4) || memcmp(magic, "P2PF", 4) != 0 ||
+        !in.read((char*)&version, sizeof(version)) || version != 1 ||
+        !in.read((char*)&count, sizeof(count))) {
+      return false;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t length;
+      uint64_t executed;
+
+      if (!in.read((char*)&length, sizeof(length))) {
+        return false;
+      }
+
+      string name(length, '\0');
+      FunctionProfile fp;
+
+      if (!in.read(&name[0], length) ||
+          !in.read((char*)&fp.numPaths, sizeof(fp.numPaths)) ||
+          !in.read((char*)&executed, sizeof(executed))) {
+        return false;
+      }
+
+      for (uint64_t j = 0; j < executed; j++) {
+        pair<uint64_t, uint64_t> c;
+
+        if (!in.read((char*)&c.first, sizeof(c.first)) ||
+            !in.read((char*)&c.second, sizeof(c.second))) {
+          return false;
+        }
+
+        fp.counts.push_back(c);
+      }
+
+      profile[name].numPaths = fp.numPaths;
+      profile[name].counts.swap(fp.counts);
+    }
+
+    return true;
+  }
+
+  bool moreRuns(const pair<uint64_t, uint64_t> &a, const pair<uint64_t, uint64_t> &b) {
+    return a.second > b.second || (a.second == b.second && a.first < b.first);
+  }
+
+  // Steensgaard's points-to analysis, flow and field insensitive. Every value
+  // and every memory object is a node, nodes are merged with union-find and
+  // each class points to at most one other class, so an assignment merges the
+  // classes the two sides point to. Casts and GEPs share the node of their
+  // base pointer. Indirect calls are bound to the functions their callee may
+  // point to, in rounds until no call gains a target.
+  class PointsTo {
+  public:
+    PointsTo(Module &M) {
+      for (Module::global_iterator gIter = M.global_begin(); gIter != M.global_end(); gIter++) {
+        if (gIter->hasInitializer()) {
+          storeConstant(deref(node(&*gIter)), gIter->getInitializer());
+        }
+      }
+
+      for (Module::iterator fIter = M.begin(); fIter != M.end(); fIter++) {
+        node(&*fIter);
+
+        for (inst_iterator I = inst_begin(*fIter), E = inst_end(*fIter); I != E; ++I) {
+          visit(&*I);
+        }
+      }
+
+      // a new target can make the callee of another call point further
+      set<pair<Instruction*, Function*> > bound;
+      bool changed = true;
+
+      while (changed) {
+        changed = false;
+
+        for (unsigned i = 0; i < indirectCalls.size(); i++) {
+          CallSite cs(indirectCalls[i]);
+          vector<Function*> targets = functions[deref(node(cs.getCalledValue()))];
+
+          for (unsigned j = 0; j < targets.size(); j++) {
+            if (bound.insert(make_pair(indirectCalls[i], targets[j])).second) {
+              bindCall(cs, targets[j]);
+              changed = true;
+            }
+          }
+        }
+      }
+    }
+
+    // functions an indirect call may reach whose parameters fit its arguments
+    void getTargets(CallSite cs, vector<Function*> &targets) {
+      const vector<Function*> &pointees = functions[deref(node(cs.getCalledValue()))];
+
+      for (unsigned i = 0; i < pointees.size(); i++) {
+        Function* f = pointees[i];
+
+        if (f->arg_size() == cs.arg_size() ||
+            (f->isVarArg() && f->arg_size() < cs.arg_size())) {
+          targets.push_back(f);
+        }
+      }
+    }
+
+  private:
+    unsigned newNode() {
+      parent.push_back(parent.size());
+      pointee.push_back(-1);
+      functions.push_back(vector<Function*>());
+      return parent.size() - 1;
+    }
+
+    unsigned find(unsigned n) {
+      while (parent[n] != n) {
+        parent[n] = parent[parent[n]];
+        n = parent[n];
+      }
+
+      return n;
+    }
+
+    // class the class of n points to, created on first use
+    unsigned deref(unsigned n) {
+      n = find(n);
+
+      if (pointee[n] < 0) {
+        int p = newNode();
+        pointee[n] = p;
+      }
+
+      return find(pointee[n]);
+    }
+
+    // merges two classes and, with a worklist, the classes they point to
+    void join(unsigned a, unsigned b) {
+      vector<pair<unsigned, unsigned> > work(1, make_pair(a, b));
+
+      while (!work.empty()) {
+        a = find(work.back().first);
+        b = find(work.back().second);
+        work.pop_back();
+
+        if (a == b) {
+          continue;
+        }
+
+        if (functions[a].size() < functions[b].size()) {
+          swap(a, b);
+        }
+
+        parent[b] = a;
+        functions[a].insert(functions[a].end(), functions[b].begin(), functions[b].end());
+        vector<Function*>().swap(functions[b]);
+
+        if (pointee[a] < 0) {
+          pointee[a] = pointee[b];
+        } else if (pointee[b] >= 0) {
+          work.push_back(make_pair((unsigned)pointee[a], (unsigned)pointee[b]));
+        }
+      }
+    }
+
+    static Value* base(Value* v) {
+      while (true) {
+        v = v->stripPointerCasts();
+
+        if (GEPOperator* gep = dyn_cast<GEPOperator>(v)) {
+          v = gep->getPointerOperand();
+        } else if (Operator::getOpcode(v) == Instruction::IntToPtr ||
+                   Operator::getOpcode(v) == Instruction::PtrToInt) {
+          v = cast<Operator>(v)->getOperand(0);
+        } else {
+          return v;
+        }
+      }
+    }
+
+    static bool isAllocation(Value* v) {
+      CallSite cs(v);
+
+      if (!cs.getInstruction()) {
+        return false;
+      }
+
+      Function* f = dyn_cast<Function>(cs.getCalledValue()->stripPointerCasts());
+
+      if (!f) {
+        return false;
+      }
+
+      StringRef name = f->getName();
+      return name == "malloc" || name == "calloc" || name == "realloc" ||
+             name == "_Znwm" || name == "_Znam" || name == "strdup";
+    }
+
+    // a global, function, stack or heap object has its own memory node
+    unsigned node(Value* v) {
+      v = base(v);
+
+      DenseMap<Value*, unsigned>::iterator it = values.find(v);
+
+      if (it != values.end()) {
+        return it->second;
+      }
+
+      unsigned n = newNode();
+      values[v] = n;
+
+      if (isa<GlobalValue>(v) || isa<AllocaInst>(v) || isAllocation(v)) {
+        unsigned object = newNode();
+
+        if (Function* f = dyn_cast<Function>(v)) {
+          functions[object].push_back(f);
+        }
+
+        join(deref(n), object);
+      }
+
+      return n;
+    }
+
+    unsigned returnNode(Function* f) {
+      DenseMap<Function*, unsigned>::iterator it = returns.find(f);
+
+      if (it != returns.end()) {
+        return it->second;
+      }
+
+      unsigned n = newNode();
+      returns[f] = n;
+      return n;
+    }
+
+    // a constant stored in memory of class "memory", e.g. a table of
+    // function pointers
+    void storeConstant(unsigned memory, Constant* c) {
+      if (isa<GlobalValue>(base(c))) {
+        join(deref(memory), deref(node(c)));
+      } else if (isa<ConstantArray>(c) || isa<ConstantStruct>(c) || isa<ConstantVector>(c)) {
+        for (unsigned i = 0; i < c->getNumOperands(); i++) {
+          storeConstant(memory, cast<Constant>(c->getOperand(i)));
+        }
+      }
+    }
+
+    void bindCall(CallSite cs, Function* f) {
+      Function::arg_iterator aIter = f->arg_begin();
+
+      for (unsigned i = 0; i < cs.arg_size() && aIter != f->arg_end(); i++, aIter++) {
+        join(deref(node(cs.getArgument(i))), deref(node(&*aIter)));
+      }
+
+      if (!cs.getType()->isVoidTy()) {
+        join(deref(node(cs.getInstruction())), deref(returnNode(f)));
+      }
+    }
+
+    void visit(Instruction* I) {
+      if (LoadInst* load = dyn_cast<LoadInst>(I)) {
+        join(deref(node(load)), deref(deref(node(load->getPointerOperand()))));
+      } else if (StoreInst* store = dyn_cast<StoreInst>(I)) {
+        join(deref(deref(node(store->getPointerOperand()))), deref(node(store->getValueOperand())));
+      } else if (PHINode* phi = dyn_cast<PHINode>(I)) {
+        for (unsigned i = 0; i < phi->getNumIncomingValues(); i++) {
+          join(deref(node(phi)), deref(node(phi->getIncomingValue(i))));
+        }
+      } else if (SelectInst* select = dyn_cast<SelectInst>(I)) {
+        join(deref(node(select)), deref(node(select->getTrueValue())));
+        join(deref(node(select)), deref(node(select->getFalseValue())));
+      } else if (ReturnInst* ret = dyn_cast<ReturnInst>(I)) {
+        if (ret->getReturnValue()) {
+          join(deref(returnNode(ret->getParent()->getParent())), deref(node(ret->getReturnValue())));
+        }
+      } else if (MemTransferInst* copy = dyn_cast<MemTransferInst>(I)) {
+        join(deref(deref(node(copy->getRawDest()))), deref(deref(node(copy->getRawSource()))));
+      } else if (CallSite cs = CallSite(I)) {
+        Value* called = cs.getCalledValue()->stripPointerCasts();
+
+        if (Function* f = dyn_cast<Function>(called)) {
+          if (!f->isDeclaration()) {
+            bindCall(cs, f);
+          }
+        } else if (!isa<InlineAsm>(called)) {
+          indirectCalls.push_back(I);
+        }
+      }
+    }
+
+    vector<unsigned> parent;
+    vector<int> pointee;                   // class pointed to, -1 for none
+    vector<vector<Function*> > functions;  // function objects of a class
+    DenseMap<Value*, unsigned> values;
+    DenseMap<Function*, unsigned> returns;
+    vector<Instruction*> indirectCalls;
+  };
+
   // Hello - The first implementation, without getAnalysisUsage.
   struct Project2 : public ModulePass {
     static char ID; // Pass identification, replacement for typeid
@@ -44,29 +747,134 @@ namespace {
       controlFlowGraph.close();
     }
 
-    virtual bool runOnModule(Module &M) override {
-      // only track control-flow-graph for main function
-      Function* mainF;
+    // everything written about one function, filled in by a worker thread
+    struct FunctionResult {
+      string callGraph, controlFlowGraph, report;
+    };
 
-      callGraph << "digraph call_graph {\n";
+    virtual bool runOnModule(Module &M) override {
+      vector<Function*> functions;
 
       for (Module::iterator fIter = M.begin(); fIter != M.end(); fIter++) {
-        Function* f = dyn_cast<Function>(&*fIter);
+        if (!fIter->isDeclaration()) {
+          functions.push_back(&*fIter);
+        }
+      }
+
+      resolveIndirectCalls(M);
+
+      map<string, FunctionProfile> profile;
+
+      if (!ProfileFile.empty() && !readProfile(ProfileFile, profile)) {
+        errs() << "can't read profile " << ProfileFile << "\n";
+      }
+
+      // functions are independent, workers take the next one until none is left
+      vector<FunctionResult> results(functions.size());
+      unsigned threads = Threads ? Threads : thread::hardware_concurrency();
+      atomic<size_t> next(0);
+
+      threads = max(1u, min<unsigned>(threads, functions.size()));
 
-        runOnFunction(*f);
+      if (threads == 1) {
+        for (size_t i = 0; i < functions.size(); i++) {
+          analyzeFunction(*functions[i], profile, results[i]);
+        }
+      } else {
+        vector<thread> pool;
+
+        for (unsigned t = 0; t < threads; t++) {
+          pool.push_back(thread([&]() {
+            for (size_t i = next++; i < functions.size(); i = next++) {
+              analyzeFunction(*functions[i], profile, results[i]);
+            }
+          }));
+        }
 
-        if (f->getName().str() == "main") {
-          mainF = f;
+        for (unsigned t = 0; t < threads; t++) {
+          pool[t].join();
         }
       }
 
-      callGraph << "}\n";
+      // merged in module order, so the output doesn't depend on the threads
+      string report;
 
+      callGraph << "digraph call_graph {\n";
       controlFlowGraph << "digraph control_flow_graph {\n";
 
-      // control flow graph for main function
-      for(Function::iterator bbIter = mainF->begin(); bbIter != mainF->end(); bbIter++) {
-        BasicBlock* bb = dyn_cast<BasicBlock>(&*bbIter);
+      for (size_t i = 0; i < results.size(); i++) {
+        callGraph << results[i].callGraph;
+        controlFlowGraph << results[i].controlFlowGraph;
+        report += results[i].report;
+      }
+
+      callGraph << "}\n";
+      controlFlowGraph << "}\n";
+      errs() << report;
+
+      return false;
+    }
+
+    // call graph edges, CFG subgraph and path report of one function
+    void analyzeFunction(Function &F, const map<string, FunctionProfile> &profile,
+                         FunctionResult &result) {
+      raw_string_ostream cg(result.callGraph), cfg(result.controlFlowGraph), out(result.report);
+      string name = F.getName().str();
+
+      runOnFunction(F, cg);
+
+      PathNumbering paths(F);
+      bool listed = PrintedFunctions.empty() ? name == "main" :
+        find(PrintedFunctions.begin(), PrintedFunctions.end(), name) != PrintedFunctions.end();
+
+      // edge frequencies and hot paths from a path profile
+      map<pair<BasicBlock*, BasicBlock*>, uint64_t> edgeRuns;
+      set<pair<BasicBlock*, BasicBlock*> > hotEdges;
+      vector<pair<uint64_t, uint64_t> > hot;
+      map<string, FunctionProfile>::const_iterator fp = profile.find(name);
+
+      if (fp != profile.end() && fp->second.numPaths != paths.getNumPaths()) {
+        out << "profile of " << name << " doesn't match its control flow graph\n";
+      } else if (fp != profile.end()) {
+        hot = fp->second.counts;
+        std::sort(hot.begin(), hot.end(), moreRuns);
+
+        for (unsigned i = 0; i < hot.size(); i++) {
+          vector<BasicBlock*> path;
+          const PathNumbering::Edge* loop = paths.getPath(hot[i].first, path);
+
+          for (unsigned j = 0; j + 1 < path.size(); j++) {
+            edgeRuns[make_pair(path[j], path[j + 1])] += hot[i].second;
+
+            if (i < HotPaths) {
+              hotEdges.insert(make_pair(path[j], path[j + 1]));
+            }
+          }
+
+          if (loop) {
+            edgeRuns[make_pair(loop->from, loop->to)] += hot[i].second;
+
+            if (i < HotPaths) {
+              hotEdges.insert(make_pair(loop->from, loop->to));
+            }
+          }
+        }
+
+        if (hot.size() > HotPaths) {
+          hot.resize(HotPaths);
+        }
+      }
+
+      // control flow graph, block names are qualified by the function
+      cfg << " subgraph \"cluster_" << name << "\" {\n";
+      cfg << "  label=\"" << name << "\";\n";
+
+      for (Function::iterator bbIter = F.begin(); bbIter != F.end(); bbIter++) {
+        cfg << "  \"" << name << "/" << bbIter->getName() << "\" [label=\"" << bbIter->getName() << "\"];\n";
+      }
+
+      for (Function::iterator bbIter = F.begin(); bbIter != F.end(); bbIter++) {
+        BasicBlock* bb = &*bbIter;
 
         TerminatorInst* termIns = bb->getTerminator();
 
@@ -74,58 +882,161 @@ namespace {
 
         for (int idx = 0; idx < sucNum; idx++) {
           BasicBlock* successor = termIns->getSuccessor(idx);
-          controlFlowGraph << " \"" << bb->getName().str() << "\" -> \"" << successor->getName().str() << "\";\n";
+          cfg << "  \"" << name << "/" << bb->getName() << "\" -> \"" << name << "/" << successor->getName() << "\"";
+
+          if (!edgeRuns.empty()) {
+            cfg << " [label=\"" << edgeRuns[make_pair(bb, successor)] << "\"";
+
+            if (hotEdges.count(make_pair(bb, successor))) {
+              cfg << ", color=red, penwidth=2";
+            }
+
+            cfg << "]";
+          }
+
+          cfg << ";\n";
         }
       }
 
-      controlFlowGraph << "}\n";
+      cfg << " }\n";
 
-      // print possible execution paths of main
-      errs() << "passible paths:\n";
-      set<BasicBlock*> path;
-      findAllPaths(mainF->begin(), path);
+      // natural loops from the dominator tree, each reported once. The
+      // analyses are built here instead of by the pass manager, which can't
+      // be used from the worker threads
+      DominatorTreeBase<BasicBlock> domTree(false);
+      LoopInfoBase<BasicBlock, Loop> loopInfo;
+      string loops;
+      raw_string_ostream loopOut(loops);
+      unsigned loopCount = 0;
 
-      return false;
-    }
+      domTree.recalculate(F);
+      loopInfo.Analyze(domTree);
 
-    void findAllPaths(BasicBlock* bb, set<BasicBlock*> path) {
-      TerminatorInst* termIns = bb->getTerminator();
+      for (LoopInfoBase<BasicBlock, Loop>::iterator lIter = loopInfo.begin(); lIter != loopInfo.end(); lIter++) {
+        loopCount += printLoop(loopOut, *lIter);
+      }
 
-      int sucNum = termIns->getNumSuccessors();
+      // a DFS back edge to a block that doesn't dominate its source closes a
+      // cycle with more than one entry
+      const vector<BasicBlock*> &blocks = paths.getBlocks();
 
-      // no further successors
-      if (sucNum == 0) {
-        printPath(bb, path);
+      for (unsigned i = blocks.size(); i-- > 0;) {
+        const vector<PathNumbering::Edge> &edges = paths.getEdges(blocks[i]);
+
+        for (unsigned j = 0; j < edges.size(); j++) {
+          if (edges[j].back && !domTree.dominates(edges[j].to, blocks[i])) {
+            loopOut << "[" << edges[j].to->getName() << "] to [" << blocks[i]->getName() << "] is an irreducible loop\n";
+          }
+        }
+      }
+
+      // path count of every function, paths of the listed ones
+      out << name << ": ";
+
+      if (paths.overflowed()) {
+        out << "more than " << UINT64_MAX;
       } else {
-        for (int idx = 0; idx < sucNum; idx++) {
-          BasicBlock* successor = termIns->getSuccessor(idx);
+        out << paths.getNumPaths();
+      }
 
-          // successor appears in path, a loop
-          if (path.find(successor) != path.end()) {
-            errs() << "[" << successor->getName() << "] to [" << bb->getName() << "] is a loop\n";
+      out << " possible paths, " << loopCount << " loops\n" << loopOut.str();
 
-            printPath(bb, path);
-          } else {
-            path.insert(bb);
-            findAllPaths(successor, path);
-            path.erase(bb);
-          }
+      if (!listed) {
+        return;
+      }
+
+      for (unsigned i = 0; i < hot.size(); i++) {
+        out << "hot path, " << hot[i].second << " runs\n";
+        printPath(out, paths, hot[i].first);
+      }
+
+      if (!paths.overflowed() && paths.getNumPaths() <= MaxPrintedPaths) {
+        for (uint64_t id = 0; id < paths.getNumPaths(); id++) {
+          printPath(out, paths, id);
+        }
+      }
+
+      for (unsigned i = 0; i < PrintedPathIds.size(); i++) {
+        if (paths.overflowed() || PrintedPathIds[i] >= paths.getNumPaths()) {
+          out << "no path " << PrintedPathIds[i] << "\n";
+        } else {
+          printPath(out, paths, PrintedPathIds[i]);
+        }
+      }
+    }
+
+    // header, depth, back edges and exits of a loop and its inner loops,
+    // returns the number of loops printed
+    unsigned printLoop(raw_ostream &out, Loop* loop) {
+      BasicBlock* header = loop->getHeader();
+      SmallVector<BasicBlock*, 8> exitEdges;
+      SmallVector<BasicBlock*, 8> exits;
+      SmallPtrSet<BasicBlock*, 8> seen;
+      const char* separator = "";
+      unsigned count = 1;
+
+      // clang output has not been through loop-simplify, so an exit may be shared
+      // with code outside the loop, e.g. the return block; getUniqueExitBlocks
+      // needs dedicated exits, getExitBlocks lists one block per exit edge
+      loop->getExitBlocks(exitEdges);
+      for (unsigned i = 0; i < exitEdges.size(); i++) {
+        if (seen.insert(exitEdges[i])) {
+          exits.push_back(exitEdges[i]);
         }
       }
+
+      out << string(2 * (loop->getLoopDepth() - 1), ' ');
+      out << "loop [" << header->getName() << "], depth " << loop->getLoopDepth()
+          << ", " << loop->getNumBlocks() << " blocks, back edges from ";
+
+      for (pred_iterator pIter = pred_begin(header); pIter != pred_end(header); pIter++) {
+        if (loop->contains(*pIter)) {
+          out << separator << "[" << (*pIter)->getName() << "]";
+          separator = ", ";
+        }
+      }
+
+      out << ", exits to ";
+      separator = "";
+
+      for (unsigned i = 0; i < exits.size(); i++) {
+        out << separator << "[" << exits[i]->getName() << "]";
+        separator = ", ";
+      }
+
+      if (exits.empty()) {
+        out << "none";
+      }
+
+      out << "\n";
+
+      for (Loop::iterator lIter = loop->begin(); lIter != loop->end(); lIter++) {
+        count += printLoop(out, *lIter);
+      }
+
+      return count;
     }
 
-    void printPath(BasicBlock* bb, set<BasicBlock*> path) {
-      set<BasicBlock*>::iterator pit;
+    void printPath(raw_ostream &out, const PathNumbering &paths, uint64_t id) {
+      vector<BasicBlock*> path;
+      const PathNumbering::Edge* loop = paths.getPath(id, path);
 
-      for(pit = path.begin(); pit != path.end(); pit++){
-        errs() << "[" << (*pit)->getName() << "] -> ";
+      out << "path " << id << ":\n";
+
+      if (loop) {
+        out << "[" << loop->to->getName() << "] to [" << loop->from->getName() << "] is a loop\n";
+      }
+
+      for (unsigned i = 0; i + 1 < path.size(); i++) {
+        out << "[" << path[i]->getName() << "] -> ";
       }
 
-      errs() << "[" << bb->getName() << "]\n\n";
+      out << "[" << path.back()->getName() << "]\n\n";
     }
 
-    virtual bool runOnFunction(Function &F) {
-      set<string> callee;
+    // call graph edges of one function, dashed for resolved indirect calls
+    void runOnFunction(Function &F, raw_ostream &out) {
+      set<string> callee, indirectCallee;
 
       for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
         CallSite cs(&*I) ;
@@ -134,6 +1045,12 @@ namespace {
           Function *f = dyn_cast<Function>(called);
           if (f) {
             callee.insert(f->getName().str());
+          } else if (!isa<InlineAsm>(called)) {
+            const vector<Function*> &targets = getIndirectTargets(cs);
+
+            for (unsigned i = 0; i < targets.size(); i++) {
+              indirectCallee.insert(targets[i]->getName().str());
+            }
           }
         }
       }
@@ -141,13 +1058,230 @@ namespace {
       set<string>::iterator it;
 
       for(it = callee.begin(); it != callee.end(); it++){
-        callGraph << " " << F.getName().str() << " -> " << *it << ";\n";
+        out << " " << F.getName() << " -> " << *it << ";\n";
       }
 
-      return false;
+      for(it = indirectCallee.begin(); it != indirectCallee.end(); it++){
+        if (callee.count(*it) == 0) {
+          out << " " << F.getName() << " -> " << *it << " [style=dashed];\n";
+        }
+      }
+    }
+
+    // candidates of indirect calls. Without points-to analysis these are the
+    // address taken functions of the call's type, with it the functions the
+    // callee may point to. Filled in before the workers start, read only after
+    void resolveIndirectCalls(Module &M) {
+      addressTaken.clear();
+      indirectTargets.clear();
+
+      for (Module::iterator fIter = M.begin(); fIter != M.end(); fIter++) {
+        if (fIter->hasAddressTaken()) {
+          addressTaken[fIter->getFunctionType()].push_back(&*fIter);
+        }
+      }
+
+      if (!UsePointsTo) {
+        return;
+      }
+
+      PointsTo pointsTo(M);
+
+      for (Module::iterator fIter = M.begin(); fIter != M.end(); fIter++) {
+        for (inst_iterator I = inst_begin(*fIter), E = inst_end(*fIter); I != E; ++I) {
+          CallSite cs(&*I);
+
+          if (cs.getInstruction() && !isa<Function>(cs.getCalledValue()->stripPointerCasts()) &&
+              !isa<InlineAsm>(cs.getCalledValue())) {
+            pointsTo.getTargets(cs, indirectTargets[&*I]);
+          }
+        }
+      }
+    }
+
+    const vector<Function*>& getIndirectTargets(CallSite cs) const {
+      static const vector<Function*> none;
+
+      if (UsePointsTo) {
+        map<Instruction*, vector<Function*> >::const_iterator it = indirectTargets.find(cs.getInstruction());
+        return it == indirectTargets.end() ? none : it->second;
+      }
+
+      FunctionType* type = cast<FunctionType>(cast<PointerType>(cs.getCalledValue()->getType())->getElementType());
+      map<FunctionType*, vector<Function*> >::const_iterator it = addressTaken.find(type);
+      return it == addressTaken.end() ? none : it->second;
+    }
+
+    map<FunctionType*, vector<Function*> > addressTaken;
+    map<Instruction*, vector<Function*> > indirectTargets;
+  };
+
+  // Ball-Larus path profiling. Every function gets a path register and an
+  // array of path counters, the register is bumped on the chords of a
+  // spanning tree and the counter of the finished path is incremented where
+  // a path ends. The counters are written out by profile_rt.c at exit.
+  struct Project2Profile : public ModulePass {
+    static char ID;
+    Project2Profile() : ModulePass(ID) {}
+
+    virtual bool runOnModule(Module &M) override {
+      LLVMContext &C = M.getContext();
+      Type* i64 = Type::getInt64Ty(C);
+      vector<pair<Function*, GlobalVariable*> > profiled;
+
+      for (Module::iterator fIter = M.begin(); fIter != M.end(); fIter++) {
+        Function* f = &*fIter;
+
+        if (f->isDeclaration() || !canSplitEdges(*f)) {
+          continue;
+        }
+
+        PathNumbering paths(*f);
+
+        if (paths.overflowed() || paths.getNumPaths() > MaxProfiledPaths) {
+          errs() << f->getName() << " is not profiled, it has too many paths\n";
+          continue;
+        }
+
+        ArrayType* countersTy = ArrayType::get(i64, paths.getNumPaths());
+        GlobalVariable* counters = new GlobalVariable(M, countersTy, false,
+          GlobalValue::InternalLinkage, ConstantAggregateZero::get(countersTy),
+          "__project2_paths." + f->getName());
+
+        instrument(*f, paths, counters);
+        profiled.push_back(make_pair(f, counters));
+      }
+
+      if (profiled.empty()) {
+        return false;
+      }
+
+      // constructor registering the counters of every function
+      Type* registerArgs[] = { Type::getInt8PtrTy(C), Type::getInt64PtrTy(C), i64 };
+      Function* registerF = M.getFunction("__project2_register");
+
+      if (!registerF) {
+        registerF = Function::Create(FunctionType::get(Type::getVoidTy(C), registerArgs, false),
+                                     GlobalValue::ExternalLinkage, "__project2_register", &M);
+      }
+
+      Function* ctor = Function::Create(FunctionType::get(Type::getVoidTy(C), false),
+        GlobalValue::InternalLinkage, "__project2_profile_init", &M);
+      IRBuilder<> builder(BasicBlock::Create(C, "entry", ctor));
+
+      for (unsigned i = 0; i < profiled.size(); i++) {
+        GlobalVariable* counters = profiled[i].second;
+        Value* args[] = {
+          builder.CreateGlobalStringPtr(profiled[i].first->getName()),
+          builder.CreateConstInBoundsGEP2_64(counters, 0, 0),
+          builder.getInt64(counters->getType()->getElementType()->getArrayNumElements())
+        };
+        builder.CreateCall(registerF, args);
+      }
+
+      builder.CreateRetVoid();
+      appendToGlobalCtors(M, ctor, 0);
+
+      return true;
+    }
+
+    // exception and indirect branch edges can't be split
+    static bool canSplitEdges(Function &F) {
+      for (Function::iterator bbIter = F.begin(); bbIter != F.end(); bbIter++) {
+        TerminatorInst* termIns = bbIter->getTerminator();
+
+        if (isa<InvokeInst>(termIns) || isa<IndirectBrInst>(termIns)) {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    void instrument(Function &F, const PathNumbering &paths, GlobalVariable* counters) {
+      PathIncrements incs(paths);
+      const vector<BasicBlock*> &blocks = paths.getBlocks();
+
+      // the numbering refers to the CFG before any edge is split. Edges are
+      // taken in topological order, code for u -> v and v -> w may both go
+      // before the terminator of v and has to run in that order
+      vector<pair<BasicBlock*, PathNumbering::Edge> > edges;
+
+      for (unsigned i = blocks.size(); i-- > 0;) {
+        const vector<PathNumbering::Edge> &out = paths.getEdges(blocks[i]);
+
+        for (unsigned j = 0; j < out.size(); j++) {
+          edges.push_back(make_pair(blocks[i], out[j]));
+        }
+      }
+
+      IRBuilder<> builder(&*F.getEntryBlock().getFirstInsertionPt());
+      AllocaInst* reg = builder.CreateAlloca(builder.getInt64Ty(), 0, "pathreg");
+      builder.CreateStore(builder.getInt64(incs.entry), reg);
+
+      for (unsigned i = 0; i < edges.size(); i++) {
+        BasicBlock* bb = edges[i].first;
+        const PathNumbering::Edge &e = edges[i].second;
+        PathIncrements::BlockPair key(bb, e.to);
+
+        if (e.back) {
+          IRBuilder<> edgeBuilder(edgeInsertPoint(bb, e.to));
+          countPath(edgeBuilder, reg, counters, incs.exits[key]);
+          edgeBuilder.CreateStore(edgeBuilder.getInt64(incs.heads[e.to]), reg);
+        } else if (incs.edges.count(key)) {
+          IRBuilder<> edgeBuilder(edgeInsertPoint(bb, e.to));
+          edgeBuilder.CreateStore(edgeBuilder.CreateAdd(edgeBuilder.CreateLoad(reg),
+                                                        edgeBuilder.getInt64(incs.edges[key])), reg);
+        }
+      }
+
+      for (unsigned i = 0; i < blocks.size(); i++) {
+        if (paths.getEdges(blocks[i]).empty()) {
+          PathIncrements::BlockPair key(blocks[i], (BasicBlock*)NULL);
+          IRBuilder<> endBuilder(blocks[i]->getTerminator());
+          countPath(endBuilder, reg, counters, incs.exits[key]);
+        }
+      }
+    }
+
+    // where code runs exactly when edge bb -> successor is taken
+    Instruction* edgeInsertPoint(BasicBlock* bb, BasicBlock* successor) {
+      TerminatorInst* termIns = bb->getTerminator();
+
+      if (!PathIncrements::needsSplit(bb, successor)) {
+        if (termIns->getNumSuccessors() == 1) {
+          return termIns;
+        }
+
+        return &*successor->getFirstInsertionPt();
+      }
+
+      unsigned idx = 0;
+
+      while (termIns->getSuccessor(idx) != successor) {
+        idx++;
+      }
+
+      return SplitCriticalEdge(termIns, idx, 0, true)->getTerminator();
+    }
+
+    // counters[register + inc]++
+    void countPath(IRBuilder<> &builder, AllocaInst* reg, GlobalVariable* counters, uint64_t inc) {
+      Value* id = builder.CreateLoad(reg);
+
+      if (inc != 0) {
+        id = builder.CreateAdd(id, builder.getInt64(inc));
+      }
+
+      Value* idx[] = { builder.getInt64(0), id };
+      Value* counter = builder.CreateInBoundsGEP(counters, idx);
+      builder.CreateStore(builder.CreateAdd(builder.CreateLoad(counter), builder.getInt64(1)), counter);
     }
   };
 }
 
 char Project2::ID = 0;
 static RegisterPass<Project2> X("Project2", "Project2 Pass");
+
+char Project2Profile::ID = 0;
+static RegisterPass<Project2Profile> Y("Project2Profile", "Project2 path profiling");
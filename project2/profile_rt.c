@@ -0,0 +1,91 @@
+/*
+ * Runtime of the Project2Profile pass. Every instrumented function registers
+ * its path counters from a module constructor, the counters are written to
+ * the profile file ($PROJECT2_PROFILE, project2.prof by default) at exit.
+ *
+ * The profile is binary in host byte order:
+ *   "P2PF", uint32 version, uint32 number of functions
+ *   per function: uint32 name length, name, uint64 number of paths,
+ *                 uint64 number of executed paths, (uint64 id, uint64 count)*
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct profile {
+  const char* name;
+  uint64_t* counters;
+  uint64_t numPaths;
+  struct profile* next;
+};
+
+static struct profile* profiles;
+
+static void writeProfile(void) {
+  const char* file = getenv("PROJECT2_PROFILE");
+  uint32_t version = 1, count = 0;
+  struct profile* p;
+  FILE* out;
+
+  if (!file || !*file) {
+    file = "project2.prof";
+  }
+
+  out = fopen(file, "wb");
+
+  if (!out) {
+    perror(file);
+    return;
+  }
+
+  for (p = profiles; p; p = p->next) {
+    count++;
+  }
+
+  fwrite("P2PF", 1, 4, out);
+  fwrite(&version, sizeof(version), 1, out);
+  fwrite(&count, sizeof(count), 1, out);
+
+  for (p = profiles; p; p = p->next) {
+    uint32_t length = strlen(p->name);
+    uint64_t executed = 0, id;
+
+    for (id = 0; id < p->numPaths; id++) {
+      executed += p->counters[id] != 0;
+    }
+
+    fwrite(&length, sizeof(length), 1, out);
+    fwrite(p->name, 1, length, out);
+    fwrite(&p->numPaths, sizeof(p->numPaths), 1, out);
+    fwrite(&executed, sizeof(executed), 1, out);
+
+    for (id = 0; id < p->numPaths; id++) {
+      if (p->counters[id]) {
+        fwrite(&id, sizeof(id), 1, out);
+        fwrite(&p->counters[id], sizeof(p->counters[id]), 1, out);
+      }
+    }
+  }
+
+  fclose(out);
+}
+
+void __project2_register(const char* name, uint64_t* counters, uint64_t numPaths) {
+  struct profile* p = malloc(sizeof(*p));
+
+  if (!p) {
+    return;
+  }
+
+  if (!profiles) {
+    atexit(writeProfile);
+  }
+
+  p->name = name;
+  p->counters = counters;
+  p->numPaths = numPaths;
+  p->next = profiles;
+  profiles = p;
+}